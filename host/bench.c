@@ -0,0 +1,600 @@
+/* bench.c
+ *   by Alex Chadwick
+ *
+ * Copyright (C) 2017, Alex Chadwick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Drives main.c, built for the host, through the model of /dev/usb/hid in
+ * ios.c. Each version is brought up, checked for sensible behaviour and then
+ * timed in the steady state. Exits non-zero if any check fails. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rvl/Pad.h>
+#include <wup028.h>
+
+#include "ios.h"
+
+/* Exported by include/bslug.h in place of BrainSlug's replacements. */
+extern void (*const bslug_replace__start)();
+extern void (*const bslug_replace_PADInit)();
+extern void (*const bslug_replace_PADRead)();
+extern void (*const bslug_replace_PADControlMotor)();
+
+/* A game calling PADRead at 60Hz. */
+#define FRAME (1000 * IOS_MS / 60)
+/* Frames to time in the steady state. */
+#define BENCH_FRAMES (60 * 60)
+
+static int failures;
+/* Whether reports show the second cable plugged in, powering rumble. */
+static int powered = 1;
+static uint64_t read_cycles;
+static uint32_t read_count;
+/* Reports to play through the adapters in the steady state, if given. */
+static WUP028Report_t *capture;
+static uint32_t capture_count;
+static int capture_playing;
+static uint32_t capture_next;
+/* Time at which capture[0] was last played. */
+static uint32_t capture_start;
+
+/* Stand ins for the game's own methods, which main.c wraps. */
+void game_start(void) {
+}
+void PADInit(void) {
+}
+
+static void check(int ok, int version, const char *what) {
+  if (!ok) {
+    printf("FAIL v%d: %s\n", version, what);
+    failures++;
+  }
+}
+
+/* Sets port 0 of the adapter's report to the given buttons and main stick,
+ * with everything else centred and the other ports empty. */
+static void setReport(int adapter, uint8_t buttons1, uint8_t x, uint8_t y) {
+  uint8_t *report = iosReport(adapter);
+  memset(report, 0, IOS_REPORT_SIZE);
+  report[0] = 0x21;
+  for (int port = 0; port < 4; port++) {
+    uint8_t *data = report + 1 + port * 9;
+    data[0] = (port == 0 ? 0x10 : 0) | (powered ? 0x04 : 0);
+    data[3] = data[4] = data[5] = data[6] = 128;
+  }
+  report[2] = buttons1;
+  report[4] = x;
+  report[5] = y;
+}
+
+/* Reads a capture dumped from wup028_capture.reports on the Wii, rotated to
+ * put the oldest report first. Times are big endian, as they were there. */
+static int loadCapture(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return -1;
+  capture = malloc(WUP028Capture_SIZE * sizeof(*capture));
+  capture_count = fread(capture, sizeof(*capture), WUP028Capture_SIZE, file);
+  fclose(file);
+  for (uint32_t i = 0; i < capture_count; i++) {
+    uint8_t *time = (uint8_t *)&capture[i].time;
+    capture[i].time =
+      (uint32_t)time[0] << 24 | time[1] << 16 | time[2] << 8 | time[3];
+  }
+  return capture_count ? 0 : -1;
+}
+
+/* Sets each adapter's report to the newest captured for it by now, keeping
+ * the spacing of the capture and starting it over once it runs out. */
+static void playCapture(void) {
+  while (
+    (int32_t)(
+      capture[capture_next].time - capture[0].time - (ios_time - capture_start)
+    ) <= 0
+  ) {
+    WUP028Report_t *report = &capture[capture_next];
+    if (report->adapter < IOS_MAX_ADAPTERS)
+      memcpy(iosReport(report->adapter), report->data, IOS_REPORT_SIZE);
+    if (++capture_next == capture_count) {
+      capture_next = 0;
+      capture_start = ios_time;
+      break;
+    }
+  }
+}
+
+/* Lets one frame pass and then reads the pads like a game would. */
+static void frame(PADData_t pads[4]) {
+  uint32_t end = ios_time + FRAME;
+  /* Step through the frame so captured reports change when they did. */
+  while (capture_playing && (int32_t)(end - ios_time) > IOS_MS) {
+    playCapture();
+    iosRun(ios_time + IOS_MS);
+  }
+  if (capture_playing)
+    playCapture();
+  iosRun(end);
+  uint64_t start = iosCycles();
+  bslug_replace_PADRead(pads);
+  read_cycles += iosCycles() - start;
+  read_count++;
+}
+
+#ifdef REPLAY_REPORTS
+/* Plays a capture written to wup028_capture between _start and PADInit, as
+ * it has to be on the Wii. No USB is used at all. */
+static void runReplay(void) {
+  PADData_t pads[4];
+
+  iosReset(5);
+  bslug_replace__start();
+  /* A report every millisecond, with A pressed from the 30th on. */
+  for (int i = 0; i < 60; i++) {
+    WUP028Report_t *report = &wup028_capture.reports[i];
+    setReport(0, i < 30 ? 0 : 0x01, 128, 128);
+    report->time = 0x12345678 + i * IOS_MS;
+    report->adapter = 0;
+    memcpy(report->data, iosReport(0), WUP028Report_SIZE);
+  }
+  wup028_capture.count = 60;
+  bslug_replace_PADInit();
+
+  frame(pads);
+  check(
+    pads[0].error == 0 && pads[0].buttons == 0 && pads[1].error != 0, 5,
+    "replay started"
+  );
+  for (int i = 0; i < 2; i++)
+    frame(pads);
+  check(pads[0].buttons == PADData_BUTTON_A, 5, "replay kept the spacing");
+  check(ios_stats.opens == 0, 5, "no USB while replaying");
+  printf("replayed %u reports\n", wup028_counters.polls_completed);
+}
+#else
+/* Whether a float is within a small fraction of one stick step of expected. */
+static int near(float value, float expected) {
+  return value - expected < 1e-4f && expected - value < 1e-4f;
+}
+
+static void run(int version) {
+  PADData_t pads[4];
+
+  iosReset(version);
+  setReport(0, 0, 128, 128);
+  setReport(1, 0, 128, 128);
+  iosSetDevices(2);
+  bslug_replace__start();
+  bslug_replace_PADInit();
+
+  /* Bring up. */
+  frame(pads);
+  check(pads[0].error == 0, version, "connected by the first PADRead");
+  check(pads[1].error == PADData_ERROR_NO_CONNECTION, version, "empty port");
+  check(ios_stats.inits == 2, version, "both adapters initialised");
+
+  /* Sequence numbers, the same when read again without a new report. */
+  WUP028Sequence_t sequence[WUP028_PORT_COUNT];
+  WUP028ReadSequence(sequence);
+  uint32_t seq = sequence[0].seq;
+  frame(pads);
+  WUP028ReadSequence(sequence);
+  check(
+    sequence[0].seq != seq && sequence[3].seq == sequence[0].seq
+    && pads[0]._unknownb[0] == (uint8_t)sequence[0].seq
+    && ios_time - sequence[0].time < FRAME,
+    version, "sequence numbers"
+  );
+  seq = sequence[0].seq;
+  bslug_replace_PADRead(pads);
+  WUP028ReadSequence(sequence);
+  check(
+    pads[0].error == PADData_ERROR_2 && sequence[0].seq == seq,
+    version, "sequence number repeated"
+  );
+
+  /* Decode. */
+  setReport(0, 0x01, 128 + 40, 128 - 20);
+  frame(pads);
+  check(pads[0].buttons == PADData_BUTTON_A, version, "A decoded");
+  check(
+    pads[0].aStickX == 40 && pads[0].aStickY == -20, version, "stick decoded"
+  );
+  check(WUP028Changed() == 1, version, "change flagged");
+  frame(pads);
+  check(pads[0].error == 0, version, "still connected when unchanged");
+  check(
+    pads[0].aStickX == 40 && WUP028Changed() == 0, version,
+    "unchanged report copied forward"
+  );
+
+  /* History, of every report since the last call. */
+  WUP028Sample_t history[WUP028_HISTORY_SIZE];
+  WUP028ReadHistory(0, history);
+  WUP028ReadSequence(sequence);
+  seq = sequence[0].seq;
+  frame(pads);
+  int count = WUP028ReadHistory(0, history);
+  WUP028ReadSequence(sequence);
+  check(
+    count == sequence[0].seq - seq && count > 0
+    && history[count - 1].data.buttons == pads[0].buttons
+    && history[count - 1].data.aStickX == pads[0].aStickX
+    && history[count - 1].time == sequence[0].time,
+    version, "history since the last call"
+  );
+  int ordered = 1;
+  for (int i = 1; i < count; i++)
+    ordered &= (int32_t)(history[i].time - history[i - 1].time) > 0;
+  check(ordered, version, "history in order");
+  check(WUP028ReadHistory(0, history) == 0, version, "history emptied");
+  /* Long enough between calls for the ring to lap. */
+  seq = sequence[0].seq;
+  uint32_t lap = 2 * WUP028_HISTORY_SIZE * ios_report_interval / FRAME + 1;
+  for (uint32_t i = 0; i < lap; i++)
+    frame(pads);
+  count = WUP028ReadHistory(0, history);
+  WUP028ReadSequence(sequence);
+  ordered = 1;
+  for (int i = 1; i < count; i++)
+    ordered &= (int32_t)(history[i].time - history[i - 1].time) > 0;
+  check(
+    sequence[0].seq - seq > WUP028_HISTORY_SIZE
+    && count == WUP028_HISTORY_SIZE && ordered
+    && history[count - 1].time == sequence[0].time,
+    version, "history keeps the newest when it laps"
+  );
+
+  /* Float sticks. */
+  setReport(0, 0, 128 - 40, 128 + 20);
+  frame(pads);
+  WUP028Sticks_t sticks[WUP028_PORT_COUNT];
+  WUP028ReadSticks(sticks);
+  check(
+    near(sticks[0].main.x, -40.0f / 127) && near(sticks[0].main.y, 20.0f / 127)
+    && sticks[1].main.x == 0,
+    version, "sticks as floats"
+  );
+  setReport(0, 0, 0, 255);
+  frame(pads);
+  WUP028ReadSticks(sticks);
+  check(
+    near(sticks[0].main.x, -0.70710678f) && near(sticks[0].main.y, 0.70710678f),
+    version, "float sticks kept within the unit circle"
+  );
+  setReport(0, 0, 128, 128);
+  frame(pads);
+
+  /* Rumble. */
+  bslug_replace_PADControlMotor(0, 1);
+  frame(pads);
+  check(ios_rumble[0][0] == 0x11 && ios_rumble[0][1] == 1, version, "rumble");
+  bslug_replace_PADControlMotor(0, 0);
+  frame(pads);
+  check(ios_rumble[0][1] == 0, version, "rumble stopped");
+  powered = 0;
+  setReport(0, 0x01, 128 + 40, 128 - 20);
+  frame(pads);
+  uint32_t rumbles = ios_stats.rumbles;
+  bslug_replace_PADControlMotor(0, 1);
+  frame(pads);
+  check(ios_stats.rumbles == rumbles, version, "no rumble without power");
+  powered = 1;
+  setReport(0, 0x01, 128 + 40, 128 - 20);
+  frame(pads);
+  check(ios_rumble[0][1] == 1, version, "rumble sent once powered");
+  bslug_replace_PADControlMotor(0, 0);
+  frame(pads);
+  /* The second adapter, through ports 4 to 7. */
+  PADData_t ports[WUP028_PORT_COUNT];
+  setReport(1, 0x08, 128 + 10, 128);
+  frame(pads);
+  WUP028Read(ports);
+  check(
+    ports[0].buttons == pads[0].buttons && ports[0].aStickX == pads[0].aStickX
+    && ports[4].error == 0 && ports[4].buttons == PADData_BUTTON_Y
+    && ports[4].aStickX == 10 && ports[5].error == PADData_ERROR_NO_CONNECTION,
+    version, "second adapter read"
+  );
+  WUP028ControlMotor(4, 1);
+  frame(pads);
+  check(
+    ios_rumble[1][0] == 0x11 && ios_rumble[1][1] == 1 && ios_rumble[0][1] == 0,
+    version, "second adapter's rumble"
+  );
+  WUP028ControlMotor(4, 0);
+  frame(pads);
+  check(ios_rumble[1][1] == 0, version, "second adapter's rumble stopped");
+  rumbles = ios_stats.rumbles;
+  WUP028ControlMotor(WUP028_PORT_COUNT, 1);
+  WUP028ControlMotor(-1, 1);
+  bslug_replace_PADControlMotor(4, 1);
+  frame(pads);
+  check(
+    ios_stats.rumbles == rumbles
+    && WUP028ReadHistory(WUP028_PORT_COUNT, history) == 0,
+    version, "ports out of range ignored"
+  );
+  setReport(1, 0, 128, 128);
+  frame(pads);
+
+  /* Slow rumbles, whose round trip is learnt even as they time out. */
+  ios_rumble_latency = 30 * IOS_MS;
+  uint32_t timeouts = 0;
+  for (int i = 0; i < 120; i++) {
+    if (i == 60)
+      timeouts = wup028_counters.rumble_timeouts;
+    bslug_replace_PADControlMotor(0, i & 1);
+    frame(pads);
+  }
+  timeouts = wup028_counters.rumble_timeouts - timeouts;
+  ios_rumble_latency = 0;
+  bslug_replace_PADControlMotor(0, 0);
+  for (int i = 0; i < 3; i++)
+    frame(pads);
+  check(timeouts == 0 && ios_rumble[0][1] == 0, version, "slow rumbles");
+
+  /* Latency probe, pressing Z, down and start together. */
+  setReport(0, 0x40, 128 + 40, 128 - 20);
+  iosReport(0)[3] = 0x03;
+  for (int i = 0; i < 3; i++)
+    frame(pads);
+  check(
+    wup028_probe.to_read.count == 1 && wup028_probe.to_rumble.count == 1
+    && wup028_probe.to_read.p50 <= wup028_probe.to_rumble.p50
+    && ios_rumble[0][1] == 0,
+    version, "probe timed the press and stopped its rumble"
+  );
+  setReport(0, 0x01, 128 + 40, 128 - 20);
+  frame(pads);
+  /* Again, with the game starting the motor while the probe has it. */
+  setReport(0, 0x40, 128 + 40, 128 - 20);
+  iosReport(0)[3] = 0x03;
+  frame(pads);
+  bslug_replace_PADControlMotor(0, 1);
+  for (int i = 0; i < 3; i++)
+    frame(pads);
+  check(
+    wup028_probe.to_rumble.count == 2 && ios_rumble[0][1] == 1,
+    version, "probe left the motor as the game last asked"
+  );
+  bslug_replace_PADControlMotor(0, 0);
+  setReport(0, 0x01, 128 + 40, 128 - 20);
+  frame(pads);
+
+  /* Watchdog, for polls IOS never completes. */
+  iosDropPolls(1);
+  for (int i = 0; i < 30; i++)
+    frame(pads);
+  check(pads[0].error == 0, version, "recovered from a dropped poll");
+
+  /* A poll IOS fails, which the adapter gets over without being unplugged. */
+  iosFailPolls(0, 1);
+  frame(pads);
+  setReport(0, 0x02, 128 + 40, 128 - 20);
+  for (int i = 0; i < 30; i++)
+    frame(pads);
+  check(
+    pads[0].error == 0 && pads[0].buttons == PADData_BUTTON_B, version,
+    "recovered from a failed poll"
+  );
+  setReport(0, 0x01, 128 + 40, 128 - 20);
+
+  /* Every poll dropped until those abandoned use up the request pool, which
+   * only reopening the interface gets back. */
+  uint32_t reconnects = wup028_counters.reconnects;
+  uint32_t open_errors = wup028_counters.errors[1];
+  /* The first try at reopening is refused outright, to be tried again. */
+  iosFailOpens(1);
+  iosDropPolls(1000);
+  for (int i = 0; i < 300 && !wup028_counters.requests_exhausted; i++)
+    frame(pads);
+  iosDropPolls(0);
+  for (int i = 0; i < 30; i++)
+    frame(pads);
+  check(
+    pads[0].error == 0 && wup028_counters.requests_exhausted != 0
+    && wup028_counters.reconnects != reconnects,
+    version, "reopened once the request pool ran out"
+  );
+  check(
+    wup028_counters.errors[1] == open_errors + 1, version,
+    "refused reopen tried again"
+  );
+
+  /* Hot plug. */
+  iosSetDevices(0);
+  for (int i = 0; i < 5; i++)
+    frame(pads);
+  check(
+    pads[0].error == PADData_ERROR_NO_CONNECTION, version, "unplug noticed"
+  );
+  iosSetDevices(1);
+  for (int i = 0; i < 5; i++)
+    frame(pads);
+  check(pads[0].error == 0, version, "plugged back in");
+  /* Plugged in again with the init lost, which the first strike of the
+   * watchdog resends, as polls go unanswered until it completes. */
+  iosSetDevices(0);
+  for (int i = 0; i < 5; i++)
+    frame(pads);
+  uint32_t watchdog_polls = wup028_counters.watchdog_polls;
+  iosDropInits(1);
+  iosSetDevices(1);
+  for (int i = 0; i < 9; i++)
+    frame(pads);
+  check(
+    pads[0].error == 0 && wup028_counters.watchdog_polls == watchdog_polls,
+    version, "lost init resent"
+  );
+  /* Found again under a new id while the old id's polls are in flight, which
+   * mustn't be taken as the new one's. */
+  uint32_t poll_errors = wup028_counters.errors[9];
+  iosReplug();
+  for (int i = 0; i < 5; i++)
+    frame(pads);
+  check(
+    pads[0].error == 0 && wup028_counters.errors[9] == poll_errors, version,
+    "replugged under a new id"
+  );
+
+  /* Idle, with the controller taken out of the adapter. */
+  setReport(0, 0, 128, 128);
+  iosReport(0)[1] &= 0x0f;
+  for (int i = 0; i < 2; i++)
+    frame(pads);
+  uint32_t idle_polls = ios_stats.polls;
+  for (int i = 0; i < 60; i++)
+    frame(pads);
+  idle_polls = ios_stats.polls - idle_polls;
+  check(
+    pads[0].error == PADData_ERROR_NO_CONNECTION && idle_polls <= 1000 / 50,
+    version, "polled slowly while empty"
+  );
+  setReport(0, 0, 128, 128);
+  /* Noticed by the next idle poll. */
+  for (int i = 0; i < 5; i++)
+    frame(pads);
+  check(pads[0].error == 0, version, "controller put back");
+
+  /* Steady state. */
+  ios_stats_t before = ios_stats;
+  WUP028Counters_t counters = wup028_counters;
+  uint32_t fresh = 0;
+  read_cycles = 0;
+  read_count = 0;
+  capture_playing = capture != NULL;
+  capture_start = ios_time;
+#ifndef NDEBUG
+  /* The ages PADRead should record, from when each result was decoded. */
+  WUP028Latency_t latency = wup028_latency;
+  WUP028Latency_t expected = { .count = 0 };
+#endif
+  for (int i = 0; i < BENCH_FRAMES; i++) {
+    /* Otherwise move the stick every frame so every report differs. */
+    if (!capture_playing)
+      setReport(0, 0, 128 + (i & 63), 128);
+    frame(pads);
+    if (pads[0].error == 0)
+      fresh++;
+#ifndef NDEBUG
+    WUP028ReadSequence(sequence);
+    uint32_t age = ios_time - sequence[0].time;
+    int bucket = age ? 32 - __builtin_clz(age) : 0;
+    if (bucket >= WUP028Latency_BUCKETS)
+      bucket = WUP028Latency_BUCKETS - 1;
+    expected.buckets[bucket]++;
+    expected.count++;
+    expected.total += age;
+#endif
+  }
+#ifndef NDEBUG
+  /* Without a capture, every report is there within the interval, so
+   * nothing disconnects. */
+  int buckets_match = 1;
+  for (int i = 0; i < WUP028Latency_BUCKETS; i++)
+    buckets_match &=
+      wup028_latency.buckets[i] - latency.buckets[i] == expected.buckets[i];
+  if (!capture)
+    check(
+      buckets_match && wup028_latency.count - latency.count == expected.count
+      && wup028_latency.total - latency.total == expected.total
+      && expected.total / expected.count < ios_report_interval,
+      version, "latency histogram matches the ages PADRead returned"
+    );
+  /* Only callbacks may call IOS with interrupts disabled, and none needs more
+   * than a few calls. */
+  check(
+    wup028_masked.callback >= ios_call_time
+    && wup028_masked.callback <= 8 * ios_call_time
+    && wup028_masked.idle_poll < ios_call_time
+    && wup028_masked.watchdog < ios_call_time
+    && wup028_masked.send < ios_call_time,
+    version, "critical sections only as long as the model allows"
+  );
+  uint64_t reads = wup028_latency.count;
+  check(
+    wup028_latency.min <= wup028_latency.max
+    && wup028_latency.total >= wup028_latency.min * reads
+    && wup028_latency.total <= wup028_latency.max * reads,
+    version, "latency total within min and max"
+  );
+#endif
+#ifdef CAPTURE_REPORTS
+  const WUP028Report_t *newest =
+    &wup028_capture.reports[(wup028_capture.count - 1) % WUP028Capture_SIZE];
+  check(
+    wup028_capture.count == wup028_counters.polls_completed
+    && memcmp(newest->data, iosReport(newest->adapter), WUP028Report_SIZE) == 0,
+    version, "every report captured"
+  );
+#endif
+  uint32_t polls = ios_stats.poll_callbacks - before.poll_callbacks;
+  uint32_t updates = wup028_counters.polls_completed - counters.polls_completed;
+  double seconds = (double)BENCH_FRAMES / 60;
+  printf(
+    "/dev/usb/hid v%d, reports every %.0f us, %.0f s of frames%s\n",
+    version, ios_report_interval * 1000.0 / IOS_MS, seconds,
+    capture ? " from the capture" : ""
+  );
+  printf(
+    "  poll callback   %8.1f cycles (decode and re-arm), %u polls\n",
+    (double)(ios_stats.poll_cycles - before.poll_cycles) / polls, polls
+  );
+  printf(
+    "  PADRead         %8.1f cycles\n", (double)read_cycles / read_count
+  );
+  printf(
+    "  updates         %8.1f per second, %.1f%% of PADReads had new data\n",
+    updates / seconds, 100.0 * fresh / BENCH_FRAMES
+  );
+  printf(
+    "  cache lines     %8.2f flushed, %.2f invalidated per poll\n",
+    (double)(ios_stats.lines_flushed - before.lines_flushed) / polls,
+    (double)(ios_stats.lines_invalidated - before.lines_invalidated) / polls
+  );
+}
+#endif
+
+int main(int argc, char **argv) {
+  /* bench [version [report interval in us [capture]]] */
+  int version = argc > 1 ? atoi(argv[1]) : 5;
+  if (version != 4 && version != 5) {
+    fprintf(
+      stderr, "usage: %s [4|5 [report interval in us [capture]]]\n", argv[0]
+    );
+    return 2;
+  }
+  if (argc > 2)
+    ios_report_interval = (uint64_t)atoi(argv[2]) * IOS_MS / 1000;
+  if (argc > 3 && loadCapture(argv[3])) {
+    fprintf(stderr, "%s: can't read capture %s\n", argv[0], argv[3]);
+    return 2;
+  }
+  /* main.c only starts once per boot, so each run is a process of its own. */
+#ifdef REPLAY_REPORTS
+  runReplay();
+#else
+  run(version);
+#endif
+  return failures != 0;
+}
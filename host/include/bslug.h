@@ -0,0 +1,46 @@
+/* bslug.h
+ *   by Alex Chadwick
+ *
+ * Copyright (C) 2017, Alex Chadwick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Stand in for BrainSlug's header when building main.c for the host. Module
+ * details are dropped, and each replacement is exported as a function pointer
+ * named bslug_replace_<original> for the harness to call. */
+
+#ifndef _BSLUG_H_
+#define _BSLUG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BSLUG_MODULE_GAME(x)
+#define BSLUG_MODULE_NAME(x)
+#define BSLUG_MODULE_VERSION(x)
+#define BSLUG_MODULE_AUTHOR(x)
+#define BSLUG_MODULE_LICENSE(x)
+
+#define BSLUG_REPLACE(original, replacement) \
+  void (*const bslug_replace_##original)() = (void (*)())(replacement)
+#define BSLUG_MUST_REPLACE(original, replacement) \
+  void (*const bslug_replace_##original)() = (void (*)())(replacement)
+
+#endif
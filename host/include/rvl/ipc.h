@@ -0,0 +1,61 @@
+/* ipc.h
+ *   by Alex Chadwick
+ *
+ * Copyright (C) 2017, Alex Chadwick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Stand in for the Wii's IPC methods when building main.c for the host. These
+ * are answered by the model of /dev/usb/hid in ios.c. */
+
+#ifndef _RVL_IPC_H_
+#define _RVL_IPC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef int ios_fd_t;
+typedef int ios_ret_t;
+typedef void *usr_t;
+typedef void (*ios_cb_t)(ios_ret_t ret, usr_t usrdata);
+
+typedef struct ioctlv ioctlv;
+
+struct ioctlv {
+  void *data;
+  uint32_t len;
+};
+
+ios_ret_t IOS_OpenAsync(
+  const char *path, int mode, ios_cb_t cb, usr_t usrdata
+);
+ios_ret_t IOS_CloseAsync(ios_fd_t fd, ios_cb_t cb, usr_t usrdata);
+ios_ret_t IOS_IoctlAsync(
+  ios_fd_t fd, int ioctl,
+  void *input, int input_length,
+  void *output, int output_length,
+  ios_cb_t cb, usr_t usrdata
+);
+ios_ret_t IOS_IoctlvAsync(
+  ios_fd_t fd, int ioctl, int in_count, int out_count, ioctlv *argv,
+  ios_cb_t cb, usr_t usrdata
+);
+
+#endif
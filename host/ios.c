@@ -0,0 +1,441 @@
+/* ios.c
+ *   by Alex Chadwick
+ *
+ * Copyright (C) 2017, Alex Chadwick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <rvl/cache.h>
+#include <rvl/ipc.h>
+
+#include "ios.h"
+
+/* Native layout of the v4 interrupt message. */
+struct interrupt_msg4 {
+  uint8_t padding[16];
+  uint32_t device;
+  uint32_t endpoint;
+  uint32_t length;
+  void *ptr;
+};
+
+#define FD 3
+#define OTHER_DEVICE_ID 0x100
+#define OTHER_DEVICE_VID_PID 0x046dc52b
+#define ADAPTER_ID(index) (0x200 + replugs * IOS_MAX_ADAPTERS + (index))
+#define ADAPTER_VID_PID 0x057e0337
+#define ADAPTER_DESCRIPTOR_SIZE 0x44
+#define OTHER_DESCRIPTOR_SIZE 0x30
+/* Error returned for requests on a missing device or a closed interface. */
+#define IOS_ERROR -4
+/* Returned at once by a request IOS can't take. */
+#define IOS_ENOMEM -22
+#define REQUEST_MAX 64
+
+enum request_kind {
+  /* Completes with ret when due. */
+  REQUEST_DONE,
+  /* Copies the adapter's report to output, unless since unplugged. */
+  REQUEST_POLL,
+  /* Waits for iosSetDevices. */
+  REQUEST_DEVICE_CHANGE
+};
+
+struct request {
+  enum request_kind kind;
+  ios_cb_t cb;
+  usr_t usr;
+  ios_ret_t ret;
+  uint32_t due;
+  /* Sent before any request with a larger order. */
+  uint32_t order;
+  int adapter;
+  void *output;
+};
+
+uint32_t ios_time;
+uint32_t ios_report_interval = 1 * IOS_MS;
+uint32_t ios_rumble_latency;
+uint32_t ios_call_time = 2 * IOS_MS / 1000;
+uint8_t ios_rumble[IOS_MAX_ADAPTERS][1 + 4];
+ios_stats_t ios_stats;
+/* See OS_IPC_HEAP_HIGH in main.c. */
+void *host_ipc_heap_high;
+/* See OS_GAME_ID in main.c. */
+char host_game_id[4] = "RHST";
+
+static int version;
+static int adapter_count;
+/* Times iosReplug was called, which changes every adapter's id. */
+static uint32_t replugs;
+static int device_change_pending;
+static int drop_polls;
+static int fail_opens;
+static int drop_inits;
+/* Set once the adapter has been sent an init since it was plugged in. Until
+ * then it never answers polls. */
+static uint8_t initialised[IOS_MAX_ADAPTERS];
+static int fail_polls[IOS_MAX_ADAPTERS];
+static uint8_t reports[IOS_MAX_ADAPTERS][IOS_REPORT_SIZE];
+/* Time of the latest report of each adapter that a poll has taken. */
+static uint32_t report_taken[IOS_MAX_ADAPTERS];
+static struct request requests[REQUEST_MAX];
+static int request_count;
+static uint32_t request_order;
+/* Room for the arena and, when built with them, captured reports. */
+static uint8_t mem2[0x8000] __attribute__((aligned(32)));
+
+uint32_t host_mftb(void) {
+  return ios_time;
+}
+
+uint64_t iosCycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+static uint32_t cacheLines(const void *start, size_t length) {
+  uintptr_t first = (uintptr_t)start & ~(uintptr_t)0x1f;
+  uintptr_t end = (uintptr_t)start + length;
+  return (end - first + 0x1f) / 0x20;
+}
+void DCFlushRange(const void *start, size_t length) {
+  ios_stats.lines_flushed += cacheLines(start, length);
+}
+void DCInvalidateRange(void *start, size_t length) {
+  ios_stats.lines_invalidated += cacheLines(start, length);
+}
+
+static struct request *addRequest(
+  enum request_kind kind, ios_cb_t cb, usr_t usr, ios_ret_t ret
+) {
+  if (request_count == REQUEST_MAX) {
+    fprintf(stderr, "ios: too many requests in flight\n");
+    exit(2);
+  }
+  struct request *request = &requests[request_count++];
+  *request = (struct request){
+    .kind = kind, .cb = cb, .usr = usr, .ret = ret,
+    .due = ios_time, .order = request_order++, .adapter = -1
+  };
+  return request;
+}
+
+static int findAdapter(uint32_t id) {
+  for (int i = 0; i < adapter_count; i++)
+    if (ADAPTER_ID(i) == id)
+      return i;
+  return -1;
+}
+
+/* Writes the device list in the version's format, returning the ioctl's
+ * result. */
+static ios_ret_t fillDevices(void *output) {
+  if (version == 4) {
+    uint32_t *words = output;
+    words[0] = OTHER_DESCRIPTOR_SIZE;
+    words[1] = OTHER_DEVICE_ID;
+    words[4] = OTHER_DEVICE_VID_PID;
+    words += OTHER_DESCRIPTOR_SIZE / 4;
+    for (int i = 0; i < adapter_count; i++) {
+      words[0] = ADAPTER_DESCRIPTOR_SIZE;
+      words[1] = ADAPTER_ID(i);
+      words[4] = ADAPTER_VID_PID;
+      words += ADAPTER_DESCRIPTOR_SIZE / 4;
+    }
+    words[0] = 0xffffffff;
+    return 0;
+  } else {
+    uint32_t *entries = output;
+    entries[0] = OTHER_DEVICE_ID;
+    entries[1] = OTHER_DEVICE_VID_PID;
+    for (int i = 0; i < adapter_count; i++) {
+      entries[3 * (i + 1)] = ADAPTER_ID(i);
+      entries[3 * (i + 1) + 1] = ADAPTER_VID_PID;
+    }
+    return 1 + adapter_count;
+  }
+}
+
+/* GET_DEVICE_CHANGE returns at once the first time, then on each change. */
+static void deviceChange(ios_cb_t cb, usr_t usr, void *output) {
+  struct request *request = addRequest(REQUEST_DEVICE_CHANGE, cb, usr, 0);
+  request->output = output;
+  if (device_change_pending) {
+    device_change_pending = 0;
+    request->kind = REQUEST_DONE;
+    request->ret = fillDevices(output);
+  }
+}
+
+static void interruptOut(
+  ios_cb_t cb, usr_t usr, uint32_t device, const uint8_t *data
+) {
+  int adapter = findAdapter(device);
+  if (adapter < 0) {
+    addRequest(REQUEST_DONE, cb, usr, IOS_ERROR);
+    return;
+  }
+  if (data[0] == 0x13 && drop_inits) {
+    drop_inits--;
+    return;
+  }
+  struct request *request = addRequest(REQUEST_DONE, cb, usr, 0);
+  if (data[0] == 0x13) {
+    ios_stats.inits++;
+    initialised[adapter] = 1;
+  } else if (data[0] == 0x11) {
+    ios_stats.rumbles++;
+    memcpy(ios_rumble[adapter], data, sizeof(ios_rumble[adapter]));
+    request->due = ios_time + ios_rumble_latency;
+  }
+}
+
+static void interruptIn(
+  ios_cb_t cb, usr_t usr, uint32_t device, void *output
+) {
+  int adapter = findAdapter(device);
+  ios_stats.polls++;
+  if (drop_polls) {
+    drop_polls--;
+    return;
+  }
+  if (adapter >= 0 && !initialised[adapter])
+    return;
+  if (adapter < 0 || fail_polls[adapter]) {
+    if (adapter >= 0)
+      fail_polls[adapter]--;
+    addRequest(REQUEST_DONE, cb, usr, IOS_ERROR);
+    return;
+  }
+  /* The adapter sends a report every interval, each to the oldest poll
+   * waiting, so polls queued together take successive reports. */
+  uint32_t due = report_taken[adapter] + ios_report_interval;
+  if ((int32_t)(due - ios_time) <= 0)
+    due += (ios_time - due) / ios_report_interval * ios_report_interval
+      + ios_report_interval;
+  report_taken[adapter] = due;
+  struct request *request = addRequest(REQUEST_POLL, cb, usr, IOS_REPORT_SIZE);
+  request->due = due;
+  request->adapter = adapter;
+  request->output = output;
+}
+
+ios_ret_t IOS_OpenAsync(
+  const char *path, int mode, ios_cb_t cb, usr_t usrdata
+) {
+  (void)mode;
+  ios_time += ios_call_time;
+  if (fail_opens) {
+    fail_opens--;
+    return IOS_ENOMEM;
+  }
+  ios_stats.opens++;
+  device_change_pending = 1;
+  addRequest(
+    REQUEST_DONE, cb, usrdata, strcmp(path, "/dev/usb/hid") ? IOS_ERROR : FD
+  );
+  return 0;
+}
+
+ios_ret_t IOS_CloseAsync(ios_fd_t fd, ios_cb_t cb, usr_t usrdata) {
+  ios_time += ios_call_time;
+  ios_stats.closes++;
+  /* Everything outstanding is cancelled. */
+  for (int i = 0; i < request_count; i++) {
+    if (requests[i].kind != REQUEST_DONE) {
+      requests[i].kind = REQUEST_DONE;
+      requests[i].ret = IOS_ERROR;
+      requests[i].due = ios_time;
+    }
+  }
+  addRequest(REQUEST_DONE, cb, usrdata, fd == FD ? 0 : IOS_ERROR);
+  return 0;
+}
+
+ios_ret_t IOS_IoctlAsync(
+  ios_fd_t fd, int ioctl,
+  void *input, int input_length,
+  void *output, int output_length,
+  ios_cb_t cb, usr_t usrdata
+) {
+  (void)input_length;
+  (void)output_length;
+  ios_time += ios_call_time;
+  if (fd != FD) {
+    addRequest(REQUEST_DONE, cb, usrdata, IOS_ERROR);
+    return 0;
+  }
+  if (version == 4) {
+    struct interrupt_msg4 *msg = input;
+    switch (ioctl) {
+      case 0: deviceChange(cb, usrdata, output); return 0;
+      case 3: interruptIn(cb, usrdata, msg->device, msg->ptr); return 0;
+      case 4: interruptOut(cb, usrdata, msg->device, msg->ptr); return 0;
+      case 6: addRequest(REQUEST_DONE, cb, usrdata, 0x00040001); return 0;
+    }
+  } else {
+    switch (ioctl) {
+      case 0:
+        ((uint32_t *)output)[0] = 0x00050001;
+        addRequest(REQUEST_DONE, cb, usrdata, 0);
+        return 0;
+      case 1: deviceChange(cb, usrdata, output); return 0;
+      case 3: case 6: case 16:
+        addRequest(REQUEST_DONE, cb, usrdata, 0);
+        return 0;
+    }
+  }
+  addRequest(REQUEST_DONE, cb, usrdata, IOS_ERROR);
+  return 0;
+}
+
+ios_ret_t IOS_IoctlvAsync(
+  ios_fd_t fd, int ioctl, int in_count, int out_count, ioctlv *argv,
+  ios_cb_t cb, usr_t usrdata
+) {
+  ios_time += ios_call_time;
+  if (fd != FD || version != 5 || ioctl != 19) {
+    addRequest(REQUEST_DONE, cb, usrdata, IOS_ERROR);
+    return 0;
+  }
+  /* The device is the first word of the endpoint descriptor. */
+  uint32_t device = ((uint32_t *)argv[0].data)[0];
+  if (in_count == 2 && out_count == 0)
+    interruptOut(cb, usrdata, device, argv[1].data);
+  else
+    interruptIn(cb, usrdata, device, argv[1].data);
+  return 0;
+}
+
+void iosReset(int new_version) {
+  version = new_version;
+  adapter_count = 0;
+  replugs = 0;
+  device_change_pending = 0;
+  drop_polls = 0;
+  fail_opens = 0;
+  drop_inits = 0;
+  memset(initialised, 0, sizeof(initialised));
+  memset(fail_polls, 0, sizeof(fail_polls));
+  memset(report_taken, 0, sizeof(report_taken));
+  request_count = 0;
+  memset(&ios_stats, 0, sizeof(ios_stats));
+  memset(ios_rumble, 0, sizeof(ios_rumble));
+  host_ipc_heap_high = mem2 + sizeof(mem2);
+}
+
+void iosSetDevices(int count) {
+  for (int i = count; i < IOS_MAX_ADAPTERS; i++)
+    initialised[i] = 0;
+  adapter_count = count;
+  device_change_pending = 1;
+  for (int i = 0; i < request_count; i++) {
+    if (requests[i].kind == REQUEST_DEVICE_CHANGE) {
+      requests[i].kind = REQUEST_DONE;
+      requests[i].ret = fillDevices(requests[i].output);
+      requests[i].due = ios_time;
+      device_change_pending = 0;
+    }
+  }
+}
+
+void iosReplug(void) {
+  replugs++;
+  memset(initialised, 0, sizeof(initialised));
+  /* Polls of the old ids fail, whenever they were due. */
+  for (int i = 0; i < request_count; i++) {
+    if (requests[i].kind == REQUEST_POLL) {
+      requests[i].kind = REQUEST_DONE;
+      requests[i].ret = IOS_ERROR;
+    }
+  }
+  iosSetDevices(adapter_count);
+}
+
+uint8_t *iosReport(int adapter) {
+  return reports[adapter];
+}
+
+void iosDropPolls(int count) {
+  drop_polls = count;
+}
+
+void iosDropInits(int count) {
+  drop_inits = count;
+}
+
+void iosFailOpens(int count) {
+  fail_opens = count;
+}
+
+void iosFailPolls(int adapter, int count) {
+  fail_polls[adapter] = count;
+}
+
+void iosRun(uint32_t until) {
+  for (;;) {
+    int next = -1;
+    for (int i = 0; i < request_count; i++) {
+      const struct request *request = &requests[i];
+      if (
+        request->kind == REQUEST_DEVICE_CHANGE
+        || (int32_t)(request->due - until) > 0
+      ) continue;
+      if (
+        next < 0
+        || (int32_t)(request->due - requests[next].due) < 0
+        || (
+          request->due == requests[next].due
+          && (int32_t)(request->order - requests[next].order) < 0
+        )
+      ) next = i;
+    }
+    if (next < 0) break;
+
+    struct request request = requests[next];
+    requests[next] = requests[--request_count];
+    if ((int32_t)(request.due - ios_time) > 0)
+      ios_time = request.due;
+    if (request.kind == REQUEST_POLL) {
+      if (request.adapter < adapter_count)
+        memcpy(request.output, reports[request.adapter], IOS_REPORT_SIZE);
+      else
+        request.ret = IOS_ERROR;
+      uint64_t start = iosCycles();
+      request.cb(request.ret, request.usr);
+      ios_stats.poll_cycles += iosCycles() - start;
+      ios_stats.poll_callbacks++;
+    } else
+      request.cb(request.ret, request.usr);
+  }
+  /* Unless the last callback's calls ran past it. */
+  if ((int32_t)(until - ios_time) > 0)
+    ios_time = until;
+}
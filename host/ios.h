@@ -0,0 +1,96 @@
+/* ios.h
+ *   by Alex Chadwick
+ *
+ * Copyright (C) 2017, Alex Chadwick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* A scripted model of IOS's /dev/usb/hid, at version 4 or 5, answering the
+ * requests main.c makes when built with the stand in headers in include/.
+ * Requests complete from iosRun in the order they fall due, which stands in for
+ * IPC interrupts arriving between the game's calls. */
+
+#ifndef _IOS_H_
+#define _IOS_H_
+
+#include <stdint.h>
+
+/* Time base units per millisecond, as on the Wii. */
+#define IOS_MS (243000 / 4)
+/* Adapters that can be plugged in. There's also always one other HID device
+ * present ahead of them. */
+#define IOS_MAX_ADAPTERS 4
+/* Size of a report from the adapter. */
+#define IOS_REPORT_SIZE 0x25
+
+typedef struct ios_stats_t ios_stats_t;
+
+struct ios_stats_t {
+  uint32_t opens;
+  uint32_t closes;
+  uint32_t inits;
+  uint32_t rumbles;
+  uint32_t polls;
+  /* Cache lines main.c asked to flush or invalidate. */
+  uint32_t lines_flushed;
+  uint32_t lines_invalidated;
+  /* Host cycles (see iosCycles) spent in callbacks for polls. */
+  uint64_t poll_cycles;
+  uint32_t poll_callbacks;
+};
+
+/* The time base, as returned by mftb. */
+extern uint32_t ios_time;
+/* How often each adapter sends a report. A poll completes with the first
+ * report not already taken by an earlier poll. */
+extern uint32_t ios_report_interval;
+/* How long IOS takes to accept each request, during which the caller's time
+ * base moves on. */
+extern uint32_t ios_call_time;
+/* How long after being sent a rumble command completes. */
+extern uint32_t ios_rumble_latency;
+/* Most recent rumble command sent to each adapter. */
+extern uint8_t ios_rumble[IOS_MAX_ADAPTERS][1 + 4];
+extern ios_stats_t ios_stats;
+
+/* Forgets all requests and devices, and sets the /dev/usb/hid version. */
+void iosReset(int version);
+/* Plugs in the first count adapters and unplugs the rest. */
+void iosSetDevices(int count);
+/* Unplugs every adapter and plugs it back in, under a new id, as one device
+ * change. */
+void iosReplug(void);
+/* The report that polls of the adapter return, header included. */
+uint8_t *iosReport(int adapter);
+/* The next count polls sent are silently dropped by "IOS". */
+void iosDropPolls(int count);
+/* The next count inits sent are silently dropped. An adapter never answers
+ * polls until it has been sent an init since being plugged in. */
+void iosDropInits(int count);
+/* The next count opens are refused without being queued. */
+void iosFailOpens(int count);
+/* The next count polls sent to the adapter fail at once. */
+void iosFailPolls(int adapter, int count);
+/* Completes requests as they fall due, up to time until. */
+void iosRun(uint32_t until);
+/* Free running counter of host cycles, for timing. */
+uint64_t iosCycles(void);
+
+#endif
@@ -32,9 +32,20 @@
 
 typedef struct PADData_t PADData_t;
 
+typedef void (*PADSamplingCallback_t)(void);
+
 void PADInit(void);
 void PADRead(PADData_t *result);
 void PADControlMotor(int pad, int control);
+void PADControlAllMotors(const uint32_t *control);
+/* mask has bit 31 - n set for pad n. Return non-zero on success. */
+int PADReset(uint32_t mask);
+int PADRecalibrate(uint32_t mask);
+void PADSetSamplingRate(uint32_t msec);
+PADSamplingCallback_t PADSetSamplingCallback(PADSamplingCallback_t callback);
+void PADSetSpec(uint32_t spec);
+void PADSetAnalogMode(uint32_t mode);
+void PADClamp(PADData_t *result);
 
 #define PADData_ERROR_NONE 0
 #define PADData_ERROR_NO_CONNECTION -1
@@ -0,0 +1,245 @@
+/* wup028.h
+ *   by Alex Chadwick
+ *
+ * Copyright (C) 2017, Alex Chadwick
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Structures and methods exported by the USB GCN Adapter Support module, for
+ * use by other modules or for inspection with a debugger. All times are in time
+ * base units (mftb), of which there are 60750 per millisecond. The layouts of
+ * the structures here are fixed; fields are only ever added to the end. */
+
+#ifndef _WUP028_H_
+#define _WUP028_H_
+
+#include <stdint.h>
+#include <rvl/Pad.h>
+
+/* Number of controller ports supported, across all adapters. Ports 0 to 3 are
+ * on the first adapter found and are the ones PADRead returns, 4 to 7 on the
+ * second and so on. */
+#define WUP028_PORT_COUNT 8
+
+/* As PADRead, but for every port. */
+void WUP028Read(PADData_t result[WUP028_PORT_COUNT]);
+/* As PADControlMotor, but for any port. Never disables interrupts, so it's
+ * safe even from a sampling callback. */
+void WUP028ControlMotor(int port, int control);
+/* Bit 1 << port set for each port whose report changed in any way, including
+ * connecting or disconnecting, between the last two times PADRead or
+ * WUP028Read returned it. Games can skip their own processing of the rest. */
+uint32_t WUP028Changed(void);
+
+/* Which report the data last returned by PADRead or WUP028Read for a port came
+ * from. Reports are numbered per adapter, so the ports of one adapter always
+ * share seq, and the difference between two reads is how many reports arrived
+ * in between. PADRead and WUP028Read also store the low byte of seq in each
+ * result's _unknownb[0]. */
+typedef struct WUP028Sequence_t WUP028Sequence_t;
+
+struct WUP028Sequence_t {
+  uint32_t seq; /* 0x0 number of the report */
+  uint32_t changed; /* 0x4 number of the last report that changed the port */
+  uint32_t time; /* 0x8 time the report was decoded */
+};
+
+void WUP028ReadSequence(WUP028Sequence_t result[WUP028_PORT_COUNT]);
+
+/* One decoded report for a single port. */
+#define WUP028_HISTORY_SIZE 32
+
+typedef struct WUP028Sample_t WUP028Sample_t;
+
+struct WUP028Sample_t {
+  PADData_t data; /* 0x0 as PADRead, but never PADData_ERROR_2 */
+  uint32_t time; /* 0xc time the report was decoded */
+};
+
+/* Copies out, oldest first, every report for the port decoded since the last
+ * call for that port, returning how many there were. Only the newest
+ * WUP028_HISTORY_SIZE are kept, so call at least that often. */
+int WUP028ReadHistory(int port, WUP028Sample_t samples[WUP028_HISTORY_SIZE]);
+
+/* A stick's position as floats, each axis from -1 to 1 and with the whole
+ * vector no longer than 1. Positive is right and up, as in PADData_t. */
+typedef struct WUP028Stick_t WUP028Stick_t;
+typedef struct WUP028Sticks_t WUP028Sticks_t;
+
+struct WUP028Stick_t {
+  float x; /* 0x0 */
+  float y; /* 0x4 */
+};
+
+struct WUP028Sticks_t {
+  WUP028Stick_t main; /* 0x0 aStickX and aStickY */
+  WUP028Stick_t c; /* 0x8 cStickX and cStickY */
+};
+
+/* The sticks of every port as last returned by PADRead or WUP028Read,
+ * normalised, after the same dead zone. Ports without a controller read as
+ * centred. Each is only converted again when its report has changed. Call
+ * from the game's thread only. */
+void WUP028ReadSticks(WUP028Sticks_t result[WUP028_PORT_COUNT]);
+
+/* Running totals describing the USB pipeline. Sample twice and divide by the
+ * difference in time to get rates. */
+#define WUP028Counters_MAGIC 0x434e5452 /* "CNTR" */
+#define WUP028Counters_ERRORS 16
+
+typedef struct WUP028Counters_t WUP028Counters_t;
+
+struct WUP028Counters_t {
+  uint32_t magic; /* 0x0 WUP028Counters_MAGIC */
+  uint32_t time; /* 0x4 time of the last poll completion */
+  uint32_t polls_sent; /* 0x8 */
+  uint32_t polls_completed; /* 0xc successful completions, including below */
+  uint32_t polls_bad; /* 0x10 completions with an unexpected header */
+  uint32_t polls_stale; /* 0x14 completions older than one already decoded */
+  uint32_t rumble_queued; /* 0x18 PADControlMotor calls changing state */
+  uint32_t rumble_coalesced; /* 0x1c PADControlMotor calls changing nothing */
+  uint32_t rumble_dropped; /* 0x20 pending states replaced before being sent */
+  uint32_t rumble_timeouts; /* 0x24 rumbles not acknowledged in time */
+  /* 0x28 failures, indexed by the method that saw them:
+   *  1 open, 2 version 4, 3 version 5, 4 device change (v5),
+   *  5 device change (v4) or attach (v5), 6 resume, 7 parameters, 8 init,
+   *  9 poll, 10 watchdog. */
+  uint32_t errors[WUP028Counters_ERRORS];
+  uint32_t reconnects; /* 0x68 times the interface was reopened after errors */
+  uint32_t watchdog_polls; /* 0x6c polls resent after completions stopped */
+  uint32_t watchdog_inits; /* 0x70 adapters initialised again after that */
+  uint32_t requests_exhausted; /* 0x74 requests not sent for want of a buffer */
+};
+
+extern WUP028Counters_t wup028_counters;
+
+/* Age of the data returned by PADRead, measured from when the report it came
+ * from was decoded. Present when the module is built without NDEBUG. Search
+ * memory for the magic to find it. */
+#define WUP028Latency_MAGIC 0x4c41544e /* "LATN" */
+#define WUP028Latency_BUCKETS 32
+
+typedef struct WUP028Latency_t WUP028Latency_t;
+
+struct WUP028Latency_t {
+  uint32_t magic; /* 0x0 WUP028Latency_MAGIC */
+  uint32_t count; /* 0x4 number of PADRead calls with a controller connected */
+  uint32_t min; /* 0x8 */
+  uint32_t max; /* 0xc */
+  uint64_t total; /* 0x10 mean = total / count */
+  /* 0x18 buckets[0] counts ages of 0, buckets[n] ages in [2^(n-1), 2^n). The
+   * last bucket also counts anything older. */
+  uint32_t buckets[WUP028Latency_BUCKETS];
+};
+
+extern WUP028Latency_t wup028_latency;
+
+/* Longest each of the module's critical sections has kept interrupts disabled,
+ * which bounds how long it delays other interrupts. Present when the module is
+ * built without NDEBUG. Search memory for the magic to find it. */
+#define WUP028Masked_MAGIC 0x4d41534b /* "MASK" */
+
+typedef struct WUP028Masked_t WUP028Masked_t;
+
+struct WUP028Masked_t {
+  uint32_t magic; /* 0x0 WUP028Masked_MAGIC */
+  /* 0x4 completion of a poll, rumble or init, dispatch included, as IOS runs
+   * callbacks with interrupts disabled */
+  uint32_t callback;
+  uint32_t _reserved8; /* 0x8 always 0, was PADControlMotor */
+  uint32_t _reservedc; /* 0xc always 0, was PADRecalibrate and PADReset */
+  uint32_t idle_poll; /* 0x10 taking the next poll of an idle adapter */
+  uint32_t watchdog; /* 0x14 abandoning polls that stopped completing */
+  uint32_t send; /* 0x18 taking requests back after failed sends, and inits */
+  uint32_t _reserved1c; /* 0x1c always 0, was latency probes */
+};
+
+extern WUP028Masked_t wup028_masked;
+
+/* End to end latency, measured each time PADData_BUTTON_Z, PADData_BUTTON_DD
+ * and PADData_BUTTON_S are pressed together on one of the ports PADRead
+ * returns. The module then times the report showing the press through to the
+ * PADRead that returns it, and on to the completion of a brief rumble it sends
+ * that port in response. Present when the module is built with PROBE_LATENCY.
+ * Search memory for the magic to find it. */
+#define WUP028Probe_MAGIC 0x50524f42 /* "PROB" */
+#define WUP028Probe_BUCKETS 64
+#define WUP028Probe_BUCKET_SIZE (243000 / 8) /* 0.5ms */
+
+typedef struct WUP028ProbeStage_t WUP028ProbeStage_t;
+typedef struct WUP028Probe_t WUP028Probe_t;
+
+/* Distribution of the time from a press's report arriving to one stage. The
+ * percentiles are the upper edges of the buckets they fall in, or max if
+ * that's less. */
+struct WUP028ProbeStage_t {
+  uint32_t count; /* 0x0 */
+  uint32_t p50; /* 0x4 */
+  uint32_t p90; /* 0x8 */
+  uint32_t p99; /* 0xc */
+  uint32_t max; /* 0x10 */
+  /* 0x14 buckets[n] counts times in [n, n + 1) * WUP028Probe_BUCKET_SIZE. The
+   * last bucket also counts anything longer. */
+  uint32_t buckets[WUP028Probe_BUCKETS];
+};
+
+struct WUP028Probe_t {
+  uint32_t magic; /* 0x0 WUP028Probe_MAGIC */
+  uint32_t report; /* 0x4 time the latest press's report arrived */
+  uint32_t read; /* 0x8 time PADRead returned it */
+  uint32_t rumble; /* 0xc time the rumble sent in response completed */
+  WUP028ProbeStage_t to_read; /* 0x10 */
+  WUP028ProbeStage_t to_rumble; /* 0x124 */
+};
+
+extern WUP028Probe_t wup028_probe;
+
+/* Raw reports as they arrived from the adapters, present when the module is
+ * built with CAPTURE_REPORTS. Built with REPLAY_REPORTS instead, the module
+ * never opens USB; it plays back, oldest first and spaced as they were
+ * recorded, whatever has been written here by the time PADInit is called.
+ * reports is only set, to an uninitialised block of MEM2, as the game starts,
+ * so a replay has to be written between then and PADInit, e.g. from a debugger
+ * stopped at PADInit. Search memory for the magic to find it. */
+#define WUP028Capture_MAGIC 0x43415054 /* "CAPT" */
+#define WUP028Capture_SIZE 256
+#define WUP028Report_SIZE 0x25
+
+typedef struct WUP028Report_t WUP028Report_t;
+typedef struct WUP028Capture_t WUP028Capture_t;
+
+struct WUP028Report_t {
+  uint32_t time; /* 0x0 time the poll completed */
+  uint8_t adapter; /* 0x4 index of the adapter, i.e. port / 4 */
+  uint8_t data[WUP028Report_SIZE]; /* 0x5 exactly as received */
+  uint8_t _padding[0x30 - 0x2a]; /* 0x2a */
+};
+
+struct WUP028Capture_t {
+  uint32_t magic; /* 0x0 WUP028Capture_MAGIC */
+  /* 0x4 reports ever recorded. The newest is at (count - 1) %
+   * WUP028Capture_SIZE, and only the newest WUP028Capture_SIZE are kept. */
+  uint32_t count;
+  WUP028Report_t *reports; /* 0x8 array of WUP028Capture_SIZE */
+};
+
+extern WUP028Capture_t wup028_capture;
+
+#endif
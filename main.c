@@ -23,9 +23,9 @@
  */
 
 /* This module adds support for the USB GCN Adapter (WUP-028). It achieves this
- * by simply replacing the Wii's PADRead and PADControlMotor calls. When PADRead
- * is called for the first time, the module initialises. Thereafter, the reading
- * of the actual USB proceeds asynchronously and continuously and the PADRead
+ * by simply replacing the Wii's PADInit, PADRead and PADControlMotor calls.
+ * When PADInit is called, the module initialises. Thereafter, the reading of
+ * the actual USB proceeds asynchronously and continuously and the PADRead
  * method just returns the result of the most recent message from the USB. The
  * outbound rumble control messages get inserted between inbound controller data
  * messages, as it seems like having both inbound and outbound messages
@@ -45,6 +45,7 @@
 #include <rvl/cache.h>
 #include <rvl/ipc.h>
 #include <rvl/Pad.h>
+#include <wup028.h>
 
 BSLUG_MODULE_GAME("????");
 BSLUG_MODULE_NAME("USB GCN Adapter Support");
@@ -61,58 +62,398 @@ BSLUG_MODULE_LICENSE("BSD");
 #define SUPPORT_DEV_USB_HID4
 #define SUPPORT_DEV_USB_HID5
 
-#define IOS_ALIGN __attribute__((aligned(32)))
+/* Rounds a size up to a whole number of cache lines. */
+#define CACHE_ROUND(size) (-(-(size) & ~0x1f))
 
 /* You can't really change this! */
 #define GCN_CONTROLLER_COUNT 4
+/* GCN_TRIGGER_*, GCN_STICK_*, POLL_DEPTH, RUMBLE_DELAY and POLL_IDLE are only
+ * defaults, which the game's entry in profiles may override. */
 /* L and R slider's "pressed" state. */
 #define GCN_TRIGGER_THRESHOLD 170
+/* Slider values up to this read as 0 and the rest are stretched to fill the
+ * range. */
+#define GCN_TRIGGER_DEAD_ZONE 0
+/* Sticks within this distance of their origin read as centred. */
+#define GCN_STICK_DEAD_ZONE 0
+/* Sticks are clamped to this distance from their origin. */
+#define GCN_STICK_RANGE 127
 /* How long (in time base units) to go without inputs before reporting a disconnect. */
 #define ms * (243000/4)
 #define GCN_TIMEOUT (1500 ms)
 /* Commands that the adapter supports. */
 #define WUP_028_CMD_RUMBLE 0x11
 #define WUP_028_CMD_INIT 0x13
+/* Bit of each port's status set while the adapter's second cable is plugged
+ * in. Without it there's no power for the motors. */
+#define WUP_028_STATUS_POWER 0x04
 /* VendorID and ProductID of the adatper. */
 #define WUP_028_ID 0x057e0337
 /* Size of the controller data returned by the adapter. */
 #define WUP_028_POLL_SIZE 0x25
-/* Size of the rumble message circular buffer. */
-#define RUMBLE_BUFFER 16
-/* Number of polls to wait before giving up on outstanding rumble command. */
+/* Size of the buffer for controller data (padded to cache line size of IOS core
+ * as otherwise IOS will write over later data, or we could read a stale value).
+ */
+#define WUP_028_POLL_BUFFER_SIZE CACHE_ROUND(WUP_028_POLL_SIZE)
+/* Sizes of the commands sent to the adapter. */
+#define WUP_028_INIT_SIZE 1
+#define WUP_028_RUMBLE_SIZE (1 + GCN_CONTROLLER_COUNT)
+/* Number of adapters to drive at once. Change WUP028_PORT_COUNT in wup028.h
+ * for more. */
+#define WUP_028_MAX_ADAPTERS (WUP028_PORT_COUNT / GCN_CONTROLLER_COUNT)
+/* Number of polls to keep in flight at once. With more than one, a report can
+ * be waiting in IOS as soon as the previous one has been decoded. */
+#ifndef POLL_DEPTH
+#define POLL_DEPTH 1
+#endif
+/* Most polls any profile can keep in flight. */
+#define POLL_DEPTH_MAX 3
+/* Define to only keep the profile's poll depth in flight shortly before the
+ * game is expected to call PADRead, and one the rest of the time. Does nothing
+ * unless the depth is more than 1. */
+/* #define POLL_SCHEDULE */
+/* Requests in the pool for a poll depth, enough for each adapter to have its
+ * polls in flight alongside as many abandoned by the watchdog, two rumbles and
+ * an init. Only as many as the profile's depth needs are given buffers. */
+#define REQUEST_COUNT_FOR(depth) (WUP_028_MAX_ADAPTERS * (2 * (depth) + 4))
+#define REQUEST_COUNT REQUEST_COUNT_FOR(POLL_DEPTH_MAX)
+/* Size of each request's buffer, enough for any of them. */
+#define REQUEST_BUFFER_SIZE WUP_028_POLL_BUFFER_SIZE
+/* Returned when there's no free request, as IOS does when out of memory. */
+#define REQUEST_POOL_EMPTY (-22)
+/* Number of round trips to wait before giving up on outstanding rumble command.
+ */
 #define RUMBLE_DELAY 3
+/* Round trip time of a rumble command to assume before any are measured, and
+ * the most it can be measured as. */
+#define RUMBLE_RTT_INITIAL (2 ms)
+#define RUMBLE_RTT_MAX (50 ms)
+/* How long an adapter can go without a poll completing before the watchdog
+ * sends a new one, or a new init if the last never completed. If that doesn't
+ * complete either, the adapter is initialised again. */
+#define POLL_WATCHDOG (100 ms)
+/* While every port of an adapter is empty, it's only polled this often (in
+ * milliseconds, at most 255). */
+#define POLL_IDLE 50
 /* Path to the USB device interface. */
 #define DEV_USB_HID_PATH "/dev/usb/hid"
+/* After an error closes the interface, wait this long before reopening it,
+ * doubling on each failure in a row up to the maximum. */
+#define RECONNECT_DELAY_INITIAL (100 ms)
+#define RECONNECT_DELAY_MAX (5000 ms)
+/* Most HID devices tracked; any beyond this are ignored. At most 32, since
+ * device_adapters is a bit mask. */
+#define DEVICE_LIST_SIZE 0x20
+/* Record the age of the data PADRead returns in wup028_latency. */
+#ifndef NDEBUG
+#define MEASURE_LATENCY
+#endif
+/* Record the longest each critical section keeps interrupts disabled in
+ * wup028_masked. Each section starts with MASKED_TIME straight after disabling
+ * them, and ends with MASKED_DONE just before restoring them. */
+#ifndef NDEBUG
+#define MEASURE_MASKED
+# define MASKED_TIME(start) uint32_t start = mftb()
+# define MASKED_DONE(section, start) \
+  measureMasked(&wup028_masked.section, start)
+#else
+# define MASKED_TIME(start) (void)0
+# define MASKED_DONE(section, start) (void)0
+#endif
+/* Time presses of PROBE_COMBO in wup028_probe. The press also blips the
+ * controller's motor. */
+/* #define PROBE_LATENCY */
+#define PROBE_COMBO (PADData_BUTTON_Z | PADData_BUTTON_DD | PADData_BUTTON_S)
+/* A probe still unfinished after this long is abandoned. */
+#define PROBE_TIMEOUT (1000 ms)
+/* Record every report received in wup028_capture. */
+/* #define CAPTURE_REPORTS */
+/* Play back the reports in wup028_capture instead of using USB at all. */
+/* #define REPLAY_REPORTS */
+#if defined(CAPTURE_REPORTS) || defined(REPLAY_REPORTS)
+#define CAPTURE_RING
+#endif
 
 /*============================================================================*/
 /* Globals */
 /*============================================================================*/
 
+#ifdef SUPPORT_DEV_USB_HID4
+struct interrupt_msg4 {
+  uint8_t padding[16];
+  uint32_t device;
+  uint32_t endpoint;
+  uint32_t length;
+  void *ptr;
+};
+#endif
+
+/* Storage for the descriptors of one IOS request, used by whichever backend is
+ * chosen. */
+union request_msg {
+#ifdef SUPPORT_DEV_USB_HID4
+  struct interrupt_msg4 msg4;
+#endif
+#ifdef SUPPORT_DEV_USB_HID5
+  ioctlv argv5[2];
+#endif
+};
+
+struct adapter;
+
+/* One IOS request to an adapter. Requests are taken from a fixed pool as they
+ * are sent and go back to it once IOS completes them, so any mix of polls,
+ * rumbles and inits to any adapters can be in flight at once. */
+struct request {
+  /* In the arena. */
+  uint8_t *buffer;
+  union request_msg *msg;
+  struct adapter *adapter;
+  /* Called with the result once IOS completes the request, or NULL while the
+   * request is free. */
+  void (*done)(struct request *request, ios_ret_t ret);
+  /* Next in the free list. */
+  struct request *next;
+  /* Time base at which the request was sent. */
+  uint32_t sent;
+  /* For polls, the order in which they were sent. */
+  uint32_t order;
+  /* Bumped each time the request is taken, so a completion is only delivered
+   * to the use it was meant for. */
+  uint8_t tag;
+  /* Set when the watchdog gives up on a poll, or the adapter is forgotten.
+   * Should it complete after all, it's just returned to the pool. */
+  uint8_t abandoned;
+};
+
+/* Controller state as published by the USB callbacks. */
+struct gcn_state {
+  PADData_t data[GCN_CONTROLLER_COUNT];
+  /* Time base at which data was decoded. */
+  uint32_t written;
+  /* Incremented on every publication. */
+  uint32_t seq;
+  /* seq of the last publication in which each controller's report changed. */
+  uint32_t changed[GCN_CONTROLLER_COUNT];
+};
+
+/* Recent reports for one controller. Written by the USB callback only; head is
+ * advanced after each sample is complete. */
+struct history {
+  WUP028Sample_t samples[WUP028_HISTORY_SIZE];
+  volatile uint32_t head;
+};
+
+/* Raw stick value to PADData_t value for each of aStickX, aStickY, cStickX and
+ * cStickY, built from the first report after the controller is connected. */
+struct calibration {
+  int8_t stick[4][256];
+};
+
+/* One WUP-028 and everything needed to drive it independently of any others.
+ */
+struct adapter {
+  /* IOS's id for the device, or -1 if this entry is free. */
+  uint32_t id;
+  /* Position in device_ids at the last device change. */
+  uint8_t slot;
+  /* Time base of the last poll completion, and how many times in a row the
+   * watchdog has fired since. */
+  volatile uint32_t poll_time;
+  uint8_t watchdog_strikes;
+  /* Set once the adapter has acknowledged an init since it was last claimed or
+   * initialised again by the watchdog. */
+  uint8_t initialised;
+  /* Set while every port is empty. The callbacks then stop sending polls, and
+   * the game's thread sends one each time idle_time passes. */
+  volatile uint8_t idle;
+  uint32_t idle_time;
+  uint8_t polls_in_flight;
+  uint32_t poll_order;
+  /* Order of the most recently decoded poll. Completions of older polls are
+   * dropped so that only the newest report wins. This is a count because the
+   * time base wraps too quickly to compare across a long disconnect. */
+  uint32_t poll_newest;
+  /* Triple buffer of controller state. The USB callback decodes into whichever
+   * slot is neither published nor being read and then publishes it with a
+   * single store, so readers never need to disable interrupts. This relies on
+   * the callbacks running to completion before the game's thread resumes. */
+  struct gcn_state state[3];
+  volatile uint8_t published;
+  volatile uint8_t reading;
+  /* Only accessed by callbacks. Bit per controller with a valid calibration. */
+  uint8_t calibrated;
+  struct calibration calibration[GCN_CONTROLLER_COUNT];
+  /* The report last decoded, and the seq it was published with. Controllers
+   * whose part of it hasn't changed are copied forward rather than decoded. */
+  uint8_t last_report[WUP_028_POLL_SIZE];
+  uint32_t last_report_seq;
+  /* Only accessed by the game's thread. */
+  uint32_t read_seq;
+  uint32_t error_seq;
+  /* Bit per controller whose report changed between the last two reads. */
+  uint8_t changed;
+  struct history history[GCN_CONTROLLER_COUNT];
+  /* Position in history up to which the game has read. */
+  uint32_t history_read[GCN_CONTROLLER_COUNT];
+  /* Each controller's sticks as floats, converted from the state whose changed
+   * sequence number is in sticks_seq. Game's thread only. */
+  WUP028Sticks_t sticks[GCN_CONTROLLER_COUNT];
+  uint32_t sticks_seq[GCN_CONTROLLER_COUNT];
+#ifdef SUPPORT_DEV_USB_HID5
+  /* In the arena, managed pretty carefully. During init it's split 0x20 bytes
+   * to 0x60 bytes to store the descriptor. The rest of the time it's split
+   * evenly, one half for rumble messages and one half for polls. Be careful!
+   */
+  uint32_t *hid5_buffer;
+#endif
+  /* Latest rumble outputs requested. Only the newest state matters, so
+   * requests made while one is pending are folded into it rather than queued.
+   * The game's thread writes an output and then its byte of rumble_dirty, both
+   * plain stores, and takeRumble clears the lot at once as it takes them. With
+   * a byte each, rather than bits, requests never have to read and write back
+   * the mask, so no request can be lost to one for another pad, whatever
+   * interrupts it. */
+  volatile uint8_t rumble_buffer[GCN_CONTROLLER_COUNT];
+  volatile union {
+    uint8_t pad[GCN_CONTROLLER_COUNT];
+    uint32_t any;
+  } rumble_dirty;
+  /* Whether the last report showed power for the motors. Pending rumbles are
+   * held until it does. */
+  uint8_t rumble_power;
+  /* Don't send next rumble until this one returns or timeout passes. The
+   * timeout is a multiple of the measured round trip time. */
+  struct request *rumble;
+  uint32_t rumble_rtt;
+#ifdef POLL_SCHEDULE
+  /* Moving average of time from sending a poll to its completion. */
+  uint32_t poll_rtt;
+#endif
+};
+
+#ifdef POLL_SCHEDULE
+/* When the game last called PADRead and a moving average of the time between
+ * calls. Written by the game's thread, read by the callbacks. */
+struct read_schedule {
+  uint32_t last;
+  uint32_t period;
+};
+#endif
+
 static ios_fd_t dev_usb_hid_fd = -1;
 static int8_t started = 0;
-static PADData_t gcn_data[GCN_CONTROLLER_COUNT];
-static uint32_t gcn_data_written;
-static uint32_t gcn_adapter_id = -1;
-#if defined(SUPPORT_DEV_USB_HID5) && defined(SUPPORT_DEV_USB_HID4)
-#define HAVE_VERSION
-static int8_t version;
+/* Set by callbacks once the interface is closed after an error; start then
+ * reopens it at reconnect_time. */
+static volatile int8_t reconnect = 0;
+static uint32_t reconnect_time;
+static uint32_t reconnect_delay = RECONNECT_DELAY_INITIAL;
+/* HID device ids in the order of the last device change, so that the next one
+ * only has to act on what's different. */
+static uint32_t device_ids[DEVICE_LIST_SIZE];
+static int device_count;
+/* Bit per entry of device_ids that is a WUP-028. */
+static uint32_t device_adapters;
+/* Connected adapters. Adapter n drives ports 4n to 4n + 3. */
+static struct adapter adapters[WUP_028_MAX_ADAPTERS] = {
+  [0 ... WUP_028_MAX_ADAPTERS - 1] = {
+    .id = -1,
+    .state = { [0 ... 2] = {
+      .data = { [0 ... GCN_CONTROLLER_COUNT - 1] = {
+        .error = PADData_ERROR_NO_CONNECTION
+      } }
+    } },
+    .rumble_rtt = RUMBLE_RTT_INITIAL
+  }
+};
+#ifdef POLL_SCHEDULE
+static volatile struct read_schedule read_schedule;
 #endif
 int8_t error;
 int8_t errorMethod;
-/* Circular buffer of rumble outputs. */
-static uint8_t rumble_sent = 0;
-static uint8_t rumble_recv = 0;
-static uint8_t rumble_buffer[RUMBLE_BUFFER][GCN_CONTROLLER_COUNT];
-/* Don't send next rumble until old one returns or timeout passes. */
-static uint8_t rumble_delay;
-static uint8_t rumble_token;
-/* Messages for device. */
-static uint8_t init_msg_buffer[1] IOS_ALIGN = { WUP_028_CMD_INIT };
-/* Pad buffer size to cache line size of IOS core. Otherwise IOS will write ver
- * later data, or we could read a stale value. */
-static uint8_t poll_msg_buffer[-(-WUP_028_POLL_SIZE & ~0x1f)] IOS_ALIGN;
-static uint8_t rumble_msg_buffer[1 + GCN_CONTROLLER_COUNT] IOS_ALIGN =
-  { WUP_028_CMD_RUMBLE };
+/* Tunables for one game. Twelve bytes, so the table of them stays small. */
+struct profile {
+  /* First four characters of the game's ID, or "????" for any game. */
+  char game[4];
+  /* Polls to keep in flight, 1 to POLL_DEPTH_MAX. */
+  uint8_t poll_depth;
+  /* Milliseconds between polls of an empty adapter. */
+  uint8_t poll_idle;
+  /* Round trips to wait for a rumble before sending the next. */
+  uint8_t rumble_delay;
+  uint8_t trigger_threshold;
+  uint8_t trigger_dead_zone;
+  uint8_t stick_dead_zone;
+  uint8_t stick_range;
+  uint8_t _padding;
+};
+/* The entry of profiles for the game being played, chosen by my_start. */
+static struct profile profile;
+/* Pool of requests to the adapters. */
+static struct request requests[REQUEST_COUNT];
+/* Number of requests in use, for the profile's poll depth. Set by my_start. */
+static int request_count;
+static struct request *requests_free;
+WUP028Counters_t wup028_counters = {
+  .magic = WUP028Counters_MAGIC
+};
+#ifdef MEASURE_LATENCY
+WUP028Latency_t wup028_latency = {
+  .magic = WUP028Latency_MAGIC,
+  .min = (uint32_t)-1
+};
+#endif
+#ifdef MEASURE_MASKED
+WUP028Masked_t wup028_masked = {
+  .magic = WUP028Masked_MAGIC
+};
+#endif
+#ifdef PROBE_LATENCY
+WUP028Probe_t wup028_probe = {
+  .magic = WUP028Probe_MAGIC
+};
+/* Progress of the current probe through the stages below. */
+enum probe_stage {
+  PROBE_IDLE,
+  /* The press has been decoded, into the state with sequence number
+   * probe_seq. */
+  PROBE_READ,
+  /* PADRead has returned it, and the rumble is waiting to be sent. */
+  PROBE_RUMBLE,
+  /* The rumble probe_request has been sent. */
+  PROBE_SENT,
+  /* It has completed, and the motor is waiting to be put back. */
+  PROBE_DONE
+};
+static volatile uint8_t probe_stage = PROBE_IDLE;
+static uint8_t probe_port;
+static struct request *probe_request;
+/* What the game last asked of each of the first adapter's motors, to restore
+ * afterwards. */
+static volatile uint8_t probe_wanted[GCN_CONTROLLER_COUNT];
+static uint32_t probe_seq;
+#endif
+#ifdef CAPTURE_RING
+WUP028Capture_t wup028_capture = {
+  .magic = WUP028Capture_MAGIC
+};
+#endif
+#ifdef REPLAY_REPORTS
+/* Ordinal in wup028_capture of the next report to play back, and the times
+ * the first one was recorded and played. */
+static uint32_t replay_next;
+static uint32_t replay_base;
+static uint32_t replay_start;
+#endif
+/* Lookup tables for decoding the adapter's button bytes, built by decodeInit.
+ */
+static uint16_t decode_buttons1[256];
+static uint16_t decode_buttons2[256];
+/* PADData_BUTTON_L if the slider counts as pressed. Shift right by one for
+ * PADData_BUTTON_R. */
+static uint16_t decode_trigger[256];
+/* Raw slider value to PADData_t value. */
+static uint8_t decode_slider[256];
 
 /*============================================================================*/
 /* Top level interface to game */
@@ -121,55 +462,278 @@ static uint8_t rumble_msg_buffer[1 + GCN_CONTROLLER_COUNT] IOS_ALIGN =
 static uint32_t mftb(void);
 static uint32_t cpu_isr_disable(void);
 static void cpu_isr_restore(uint32_t isr);
+static void compiler_barrier(void);
+static void decodeInit(void);
+#ifdef MEASURE_LATENCY
+static void measureLatency(uint32_t age);
+#endif
+#ifdef MEASURE_MASKED
+static void measureMasked(uint32_t *longest, uint32_t start);
+#endif
+#ifdef PROBE_LATENCY
+static void probeRead(void);
+#endif
+static int openDevice(void);
 static void onDevOpen(ios_fd_t fd, usr_t unused);
+static void onDevClose(ios_ret_t ret, usr_t unused);
+static void idlePoll(struct adapter *adapter);
+static void watchdog(struct adapter *adapter);
+#ifdef REPLAY_REPORTS
+static void replayBegin(void);
+static void replayReports(void);
+#endif
 
-static void myPADInit(void) {
-  /* FIXME: Until we've killed all PAD methods, better init still. */
-  PADInit();
+#ifdef POLL_SCHEDULE
+/* Calls further apart than this aren't counted towards the read period. */
+# define READ_PERIOD_MAX (100 ms)
+
+static void learnReadSchedule(void) {
+  uint32_t now = mftb();
+  uint32_t period = now - read_schedule.last;
+  if (period < READ_PERIOD_MAX)
+    read_schedule.period += (int32_t)(period - read_schedule.period) / 8;
+  read_schedule.last = now;
 }
-static void myPADRead(PADData_t result[GCN_CONTROLLER_COUNT]) {
-  uint32_t isr = cpu_isr_disable();
+#endif
+
+static void start(void) {
+#ifdef REPLAY_REPORTS
   if (!started) {
-    /* On first call only, initialise USB and globals. */
+    /* On first call only, begin playback. */
     started = 1;
-    for (int i = 0; i < GCN_CONTROLLER_COUNT; i++)
-      gcn_data[i].error = PADData_ERROR_NO_CONNECTION;
-    gcn_data_written = mftb();
-    IOS_OpenAsync(DEV_USB_HID_PATH, 0, onDevOpen, NULL);
+    decodeInit();
+    replayBegin();
+  }
+  replayReports();
+  return;
+#endif
+  if (!started) {
+    /* On first call only, initialise USB. */
+    started = 1;
+    decodeInit();
+    openDevice();
+  } else if (reconnect && (int32_t)(mftb() - reconnect_time) >= 0) {
+    /* No callbacks touch reconnect until the open has run. */
+    reconnect = 0;
+    if (openDevice() == 0)
+      wup028_counters.reconnects++;
   }
   if (errorMethod > 0) {
-    /* On a USB error, disconnect all controllers. */
+    /* On a USB error, disconnect all controllers until the next update. */
     errorMethod = -errorMethod;
-    for (int i = 0; i < GCN_CONTROLLER_COUNT; i++)
-      gcn_data[i].error = PADData_ERROR_NO_CONNECTION;
-  } else if (mftb() - gcn_data_written > GCN_TIMEOUT) {
-    for (int i = 0; i < GCN_CONTROLLER_COUNT; i++)
-      gcn_data[i].error = PADData_ERROR_NO_CONNECTION;
+    for (int i = 0; i < WUP_028_MAX_ADAPTERS; i++)
+      adapters[i].error_seq = adapters[i].state[adapters[i].published].seq;
   }
+}
+/* Copies out the controllers of one adapter, returning the age of the data or
+ * -1 if they're all disconnected. */
+static uint32_t readAdapter(
+  struct adapter *adapter, PADData_t result[GCN_CONTROLLER_COUNT]
+) {
+  /* Claim the published slot. Should a callback publish between these two
+   * statements it will still never write to the slot we've claimed. */
+  uint8_t slot = adapter->published;
+  adapter->reading = slot;
+  compiler_barrier();
+  const struct gcn_state *state = &adapter->state[slot];
+  uint32_t age = mftb() - state->written;
+  adapter->changed = 0;
+  for (int i = 0; i < GCN_CONTROLLER_COUNT; i++)
+    if ((int32_t)(state->changed[i] - adapter->read_seq) > 0)
+      adapter->changed |= 1 << i;
+  int disconnect = 0;
+  if (state->seq == adapter->error_seq && errorMethod != 0)
+    disconnect = 1;
+  else if (age > GCN_TIMEOUT)
+    disconnect = 1;
   for (int i = 0; i < GCN_CONTROLLER_COUNT; i++) {
     /* Copy last seen controller inputs. */
-    result[i] = gcn_data[i];
-    if (gcn_data[i].error == 0)
-      gcn_data[i].error = PADData_ERROR_2;
+    result[i] = state->data[i];
+    /* Enough to tell repeats apart, without WUP028ReadSequence. */
+    result[i]._unknownb[0] = (uint8_t)state->seq;
+    if (disconnect)
+      result[i].error = PADData_ERROR_NO_CONNECTION;
+    else if (result[i].error == 0 && state->seq == adapter->read_seq)
+      result[i].error = PADData_ERROR_2;
+  }
+  adapter->read_seq = state->seq;
+  return disconnect ? (uint32_t)-1 : age;
+}
+
+static void myPADInit(void) {
+  /* FIXME: Until we've killed all PAD methods, better init still. */
+  PADInit();
+  /* Get the adapter streaming before the game's first PADRead. This can't be
+   * done any sooner, e.g. in my_start, as IPC isn't set up until OSInit. */
+  start();
+}
+static void myPADRead(PADData_t result[GCN_CONTROLLER_COUNT]) {
+  start();
+  idlePoll(&adapters[0]);
+  watchdog(&adapters[0]);
+#ifdef POLL_SCHEDULE
+  learnReadSchedule();
+#endif
+  uint32_t age = readAdapter(&adapters[0], result);
+#ifdef MEASURE_LATENCY
+  if (age != (uint32_t)-1)
+    measureLatency(age);
+#else
+  (void)age;
+#endif
+#ifdef PROBE_LATENCY
+  probeRead();
+#endif
+}
+void WUP028Read(PADData_t result[WUP028_PORT_COUNT]) {
+  start();
+  for (int i = 0; i < WUP_028_MAX_ADAPTERS; i++) {
+    idlePoll(&adapters[i]);
+    watchdog(&adapters[i]);
+  }
+  for (int i = 0; i < WUP_028_MAX_ADAPTERS; i++)
+    readAdapter(&adapters[i], result + i * GCN_CONTROLLER_COUNT);
+}
+void WUP028ControlMotor(int port, int control) {
+  /* Check for valid port. */
+  if ((unsigned int)port >= WUP028_PORT_COUNT) return;
+  struct adapter *adapter = &adapters[port / GCN_CONTROLLER_COUNT];
+  int pad = port % GCN_CONTROLLER_COUNT;
+#ifdef PROBE_LATENCY
+  if (adapter == &adapters[0]) {
+    probe_wanted[pad] = control;
+    compiler_barrier();
+    /* Held until the probe's blip is over. */
+    if (probe_stage >= PROBE_RUMBLE && pad == probe_port) return;
+  }
+#endif
+  /* Check if this command is redundant. */
+  if (adapter->rumble_buffer[pad] == (uint8_t)control)
+    wup028_counters.rumble_coalesced++;
+  else {
+    if (adapter->rumble_dirty.pad[pad])
+      wup028_counters.rumble_dropped++;
+    else
+      wup028_counters.rumble_queued++;
+    adapter->rumble_buffer[pad] = control;
+    /* Should a callback take the output before it sees this, the same output
+     * is just sent again. */
+    adapter->rumble_dirty.pad[pad] = 1;
+  }
+}
+uint32_t WUP028Changed(void) {
+  uint32_t changed = 0;
+  for (int i = 0; i < WUP_028_MAX_ADAPTERS; i++)
+    changed |= (uint32_t)adapters[i].changed << (i * GCN_CONTROLLER_COUNT);
+  return changed;
+}
+int WUP028ReadHistory(int port, WUP028Sample_t samples[WUP028_HISTORY_SIZE]) {
+  if ((unsigned int)port >= WUP028_PORT_COUNT) return 0;
+  struct adapter *adapter = &adapters[port / GCN_CONTROLLER_COUNT];
+  struct history *history = &adapter->history[port % GCN_CONTROLLER_COUNT];
+  uint32_t *read = &adapter->history_read[port % GCN_CONTROLLER_COUNT];
+  uint32_t head = history->head;
+  uint32_t tail = *read;
+  if (head - tail > WUP028_HISTORY_SIZE)
+    tail = head - WUP028_HISTORY_SIZE;
+  compiler_barrier();
+  for (uint32_t i = tail; i != head; i++)
+    samples[i - tail] = history->samples[i % WUP028_HISTORY_SIZE];
+  compiler_barrier();
+  /* Drop any samples a callback overwrote while we were copying. */
+  uint32_t oldest = history->head - WUP028_HISTORY_SIZE;
+  int count = head - tail;
+  if ((int32_t)(oldest - tail) > 0) {
+    int lost = oldest - tail;
+    if (lost > count) lost = count;
+    for (int i = lost; i < count; i++)
+      samples[i - lost] = samples[i];
+    count -= lost;
+  }
+  *read = head;
+  return count;
+}
+void WUP028ReadSequence(WUP028Sequence_t result[WUP028_PORT_COUNT]) {
+  for (int i = 0; i < WUP_028_MAX_ADAPTERS; i++) {
+    const struct adapter *adapter = &adapters[i];
+    /* Still claimed by the last read, so no callback writes it. */
+    const struct gcn_state *state = &adapter->state[adapter->reading];
+    for (int j = 0; j < GCN_CONTROLLER_COUNT; j++) {
+      WUP028Sequence_t *sequence = &result[i * GCN_CONTROLLER_COUNT + j];
+      sequence->seq = state->seq;
+      sequence->changed = state->changed[j];
+      sequence->time = state->written;
+    }
+  }
+}
+/* 1 / sqrt(value), without the library call fsqrt would otherwise be. */
+static float reciprocalSqrt(float value) {
+  float estimate;
+#ifdef GEKKO
+  __asm__ ("frsqrte %0, %1" : "=f" (estimate) : "f" (value));
+#else
+  /* About as close as frsqrte, from the bits of the float. */
+  uint32_t bits;
+  __builtin_memcpy(&bits, &value, 4);
+  bits = 0x5f3759df - (bits >> 1);
+  __builtin_memcpy(&estimate, &bits, 4);
+#endif
+  /* Newton-Raphson, twice to get from the estimate to nearly full precision. */
+  for (int i = 0; i < 2; i++)
+    estimate *= 1.5f - 0.5f * value * estimate * estimate;
+  return estimate;
+}
+static void stickToFloat(WUP028Stick_t *result, int x, int y) {
+  int range = profile.stick_range;
+  float scale;
+  /* Beyond the range diagonally, pull back onto the unit circle. */
+  if (x * x + y * y > range * range)
+    scale = reciprocalSqrt(x * x + y * y);
+  else
+    scale = 1.0f / range;
+  float axes[2] = { x, y };
+#ifdef GEKKO
+  /* Both axes in one multiply. GQR0 is left all zero by the OS, making these
+   * plain float loads and stores. */
+  double pair;
+  __asm__ (
+    "psq_l %0, 0(%1), 0, 0\n\t"
+    "ps_muls0 %0, %0, %2\n\t"
+    "psq_st %0, 0(%3), 0, 0"
+    : "=&f" (pair)
+    : "b" (axes), "f" (scale), "b" (result)
+    : "memory"
+  );
+#else
+  result->x = axes[0] * scale;
+  result->y = axes[1] * scale;
+#endif
+}
+void WUP028ReadSticks(WUP028Sticks_t result[WUP028_PORT_COUNT]) {
+  for (int i = 0; i < WUP_028_MAX_ADAPTERS; i++) {
+    struct adapter *adapter = &adapters[i];
+    /* Still claimed by the last read, so no callback writes it. */
+    const struct gcn_state *state = &adapter->state[adapter->reading];
+    for (int j = 0; j < GCN_CONTROLLER_COUNT; j++) {
+      WUP028Sticks_t *sticks = &adapter->sticks[j];
+      if (state->changed[j] != adapter->sticks_seq[j]) {
+        const PADData_t *pad = &state->data[j];
+        adapter->sticks_seq[j] = state->changed[j];
+        if (pad->error != 0)
+          *sticks = (WUP028Sticks_t){ { 0, 0 }, { 0, 0 } };
+        else {
+          stickToFloat(&sticks->main, pad->aStickX, pad->aStickY);
+          stickToFloat(&sticks->c, pad->cStickX, pad->cStickY);
+        }
+      }
+      result[i * GCN_CONTROLLER_COUNT + j] = *sticks;
+    }
   }
-  cpu_isr_restore(isr);
 }
 static void myPADControlMotor(int pad, int control) {
   /* Check for valid pad. */
   if ((unsigned int)pad >= GCN_CONTROLLER_COUNT) return;
-  uint32_t isr = cpu_isr_disable();
-  unsigned int prev = (unsigned int)(rumble_sent - 1) % RUMBLE_BUFFER;
-  /* Check if this command is redundant. */
-  if (rumble_buffer[prev][pad] == (uint8_t)control) goto exit;
-  /* Put this rumble command into a queue. */
-  for (int i = 0; i < GCN_CONTROLLER_COUNT; i++)
-    if (i == pad)
-      rumble_buffer[rumble_sent][i] = control;
-    else
-      rumble_buffer[rumble_sent][i] = rumble_buffer[prev][i];
-  rumble_sent = (rumble_sent + 1) % RUMBLE_BUFFER;
-exit:
-  cpu_isr_restore(isr);
+  WUP028ControlMotor(pad, control);
 }
 
 BSLUG_MUST_REPLACE(PADInit, myPADInit);
@@ -180,6 +744,7 @@ BSLUG_REPLACE(PADControlMotor, myPADControlMotor);
 /* USB support */
 /*============================================================================*/
 
+#ifdef GEKKO
 static uint32_t mftb(void) {
   uint32_t result;
   asm volatile ("mftb %0" : "=r"(result));
@@ -194,10 +759,168 @@ static void cpu_isr_restore(uint32_t isr) {
   uint32_t tmp;
   asm volatile ("mfmsr %0; rlwimi %0, %1, 0, 0x8000; mtmsr %0" : "=&r"(tmp) : "r" (isr));
 }
+#else
+/* Built for the harness in host/, which runs callbacks between calls from the
+ * game rather than interrupting them. */
+uint32_t host_mftb(void);
+static uint32_t mftb(void) {
+  return host_mftb();
+}
+static uint32_t cpu_isr_disable(void) {
+  return 0;
+}
+static void cpu_isr_restore(uint32_t isr) {
+  (void)isr;
+}
+#endif
+static void compiler_barrier(void) {
+  asm volatile ("" ::: "memory");
+}
+
+/* IOS accesses memory directly, bypassing the CPU's cache. Anything the CPU
+ * writes for IOS to read must be flushed before sending, and anything IOS
+ * writes must be invalidated before the CPU reads it. Only the cache lines
+ * actually holding the size bytes are touched. */
+static void cacheToDevice(const void *buffer, uint32_t size) {
+  DCFlushRange(buffer, size);
+}
+static void cacheFromDevice(void *buffer, uint32_t size) {
+  DCInvalidateRange(buffer, size);
+}
+
+#ifdef MEASURE_MASKED
+static void measureMasked(uint32_t *longest, uint32_t start) {
+  uint32_t time = mftb() - start;
+  if (time > *longest)
+    *longest = time;
+}
+#endif
+
+#ifdef MEASURE_LATENCY
+static void measureLatency(uint32_t age) {
+  /* Bucket is the number of significant bits in age. */
+  int bucket = age ? 32 - __builtin_clz(age) : 0;
+  if (bucket >= WUP028Latency_BUCKETS)
+    bucket = WUP028Latency_BUCKETS - 1;
+  wup028_latency.buckets[bucket]++;
+  wup028_latency.count++;
+  wup028_latency.total += age;
+  if (age < wup028_latency.min)
+    wup028_latency.min = age;
+  if (age > wup028_latency.max)
+    wup028_latency.max = age;
+}
+#endif
+
+#ifdef PROBE_LATENCY
+static void probeRecord(WUP028ProbeStage_t *stage, uint32_t time) {
+  uint32_t bucket = time / WUP028Probe_BUCKET_SIZE;
+  if (bucket >= WUP028Probe_BUCKETS)
+    bucket = WUP028Probe_BUCKETS - 1;
+  stage->buckets[bucket]++;
+  stage->count++;
+  if (time > stage->max)
+    stage->max = time;
+  /* Presses are rare enough to recount from scratch each time. */
+  uint32_t seen = 0;
+  stage->p50 = stage->p90 = stage->p99 = 0;
+  for (int i = 0; i < WUP028Probe_BUCKETS; i++) {
+    uint32_t edge = (i + 1) * WUP028Probe_BUCKET_SIZE;
+    if (edge > stage->max)
+      edge = stage->max;
+    seen += stage->buckets[i];
+    if (!stage->p50 && seen * 100 >= stage->count * 50)
+      stage->p50 = edge;
+    if (!stage->p90 && seen * 100 >= stage->count * 90)
+      stage->p90 = edge;
+    if (!stage->p99 && seen * 100 >= stage->count * 99)
+      stage->p99 = edge;
+  }
+}
+/* Called by the decode for each of the first adapter's controllers. */
+static void probePress(int port, const PADData_t *pad, const PADData_t *last) {
+  if (
+    probe_stage == PROBE_IDLE
+    && (pad->buttons & PROBE_COMBO) == PROBE_COMBO
+    && (last->error != 0 || (last->buttons & PROBE_COMBO) != PROBE_COMBO)
+  ) {
+    struct adapter *adapter = &adapters[0];
+    wup028_probe.report = wup028_counters.time;
+    probe_port = port;
+    probe_seq = adapter->state[adapter->published].seq + 1;
+    probe_stage = PROBE_READ;
+  }
+}
+/* Called after each PADRead. */
+static void probeRead(void) {
+  struct adapter *adapter = &adapters[0];
+  uint32_t now = mftb();
+  if (probe_stage == PROBE_IDLE) return;
+  if (
+    probe_stage == PROBE_READ
+    && (int32_t)(adapter->read_seq - probe_seq) >= 0
+  ) {
+    wup028_probe.read = now;
+    probeRecord(&wup028_probe.to_read, now - wup028_probe.report);
+    probe_stage = PROBE_RUMBLE;
+    /* Sent even if the motor is already on, so there's a rumble to time. The
+     * stage must change before a callback can take the rumble. */
+    compiler_barrier();
+    adapter->rumble_buffer[probe_port] = 1;
+    adapter->rumble_dirty.pad[probe_port] = 1;
+  } else if (
+    probe_stage == PROBE_DONE || now - wup028_probe.report > PROBE_TIMEOUT
+  ) {
+    /* Only a blip, so put back whatever the game wants now. Timing out is
+     * e.g. for no power for the motors. Once idle, a rumble completing just as
+     * this runs leaves the stage alone, and the game's requests go through
+     * again. */
+    int restore = probe_stage >= PROBE_RUMBLE;
+    probe_stage = PROBE_IDLE;
+    compiler_barrier();
+    if (restore)
+      WUP028ControlMotor(probe_port, probe_wanted[probe_port]);
+  }
+}
+#endif
+
+/* Callbacks of requests from the pool are given the request's index and tag.
+ */
+#define REQUEST_USR(request) \
+  ((usr_t)(uint32_t)(((request) - requests) << 8 | (request)->tag))
+
+static void onRequest(ios_ret_t ret, usr_t vrequest);
+static int sendInit(struct adapter *adapter);
+static void onDevUsbInit(struct request *init, ios_ret_t ret);
+static void onDevUsbPoll(struct request *poll, ios_ret_t ret);
+static void forgetAdapter(struct adapter *adapter);
+#ifdef CAPTURE_REPORTS
+static void captureReport(
+  struct adapter *adapter, const uint8_t *data, uint32_t time
+);
+#endif
 
-static void callbackIgnore(ios_ret_t ret, usr_t unused);
-static void onDevUsbInit(ios_ret_t ret, usr_t unused);
-static void onDevUsbPoll(ios_ret_t ret, usr_t unused);
+/* Operations which differ between /dev/usb/hid versions. Each supported version
+ * provides one of these. The one matching the IOS is chosen once, when the
+ * version is checked, so the steady state never has to check again. */
+struct backend {
+  /* Sends GET_VERSION. on_version is given the index into backends. */
+  int (*get_version)(ios_cb_t cb, usr_t data);
+  ios_cb_t on_version;
+  /* Takes the backend's own buffers from the arena. */
+  void (*alloc)(void);
+  /* Waits for the next device change. */
+  int (*device_change)(void);
+  /* Brings up the adapter, finishing with onDevUsbInit. */
+  int (*init)(struct adapter *adapter);
+  /* Reads size bytes from the request's adapter into its buffer, or writes
+   * them out of it. Both complete with onRequest. */
+  int (*interrupt_in)(struct request *request, uint32_t size);
+  int (*interrupt_out)(struct request *request, uint32_t size);
+};
+static const struct backend *backend;
+
+static void *arenaAlloc(uint32_t size);
 
 #ifdef SUPPORT_DEV_USB_HID4
   /* The basic flow for version 4:
@@ -228,37 +951,12 @@ static void onDevUsbPoll(ios_ret_t ret, usr_t unused);
   /* Version id. */
 # define DEV_USB_HID4_VERSION 0x00040001
 
-static uint32_t dev_usb_hid4_devices[DEV_USB_HID4_DEVICE_CHANGE_SIZE] IOS_ALIGN;
-struct interrupt_msg4 {
-  uint8_t padding[16];
-  uint32_t device;
-  uint32_t endpoint;
-  uint32_t length;
-  void *ptr;
-};
-
-static struct interrupt_msg4 init_msg4 IOS_ALIGN = {
-  .device = -1,
-  .endpoint = WUP_028_ENDPOINT_OUT,
-  .length = sizeof(init_msg_buffer),
-  .ptr = init_msg_buffer
-};
+  /* Arena needed beyond that for every backend. */
+# define ARENA_SIZE4 (DEV_USB_HID4_DEVICE_CHANGE_SIZE * 4)
 
-static struct interrupt_msg4 poll_msg4 IOS_ALIGN = {
-  .device = -1,
-  .endpoint = WUP_028_ENDPOINT_IN,
-  .length = WUP_028_POLL_SIZE,
-  .ptr = poll_msg_buffer
-};
+static uint32_t *dev_usb_hid4_devices;
 
-static struct interrupt_msg4 rumble_msg4 IOS_ALIGN = {
-  .device = -1,
-  .endpoint = WUP_028_ENDPOINT_OUT,
-  .length = sizeof(rumble_msg_buffer),
-  .ptr = rumble_msg_buffer
-};
-
-static void onDevGetVersion4(ios_ret_t ret, usr_t unused);
+static void onDevGetVersion4(ios_ret_t ret, usr_t vindex);
 static void onDevUsbChange4(ios_ret_t ret, usr_t unused);
 
 static int checkVersion4(ios_cb_t cb, usr_t data) {
@@ -273,43 +971,60 @@ static int getDeviceChange4(ios_cb_t cb, usr_t data) {
   return  IOS_IoctlAsync(
     dev_usb_hid_fd, DEV_USB_HID4_IOCTL_GET_DEVICE_CHANGE,
     NULL, 0,
-    dev_usb_hid4_devices, sizeof(dev_usb_hid4_devices),
+    dev_usb_hid4_devices, DEV_USB_HID4_DEVICE_CHANGE_SIZE * 4,
     cb, data
   );
 }
 
-static int sendInit4(ios_cb_t cb, usr_t data) {
-  init_msg4.device = gcn_adapter_id;
+static int sendInterrupt4(
+  struct request *request, int ioctl, uint32_t endpoint, uint32_t size
+) {
+  struct interrupt_msg4 *msg = &request->msg->msg4;
+  msg->device = request->adapter->id;
+  msg->endpoint = endpoint;
+  msg->length = size;
+  msg->ptr = request->buffer;
   return IOS_IoctlAsync(
-    dev_usb_hid_fd, DEV_USB_HID4_IOCTL_INTERRUPT_OUT,
-    &init_msg4, sizeof(init_msg4),
+    dev_usb_hid_fd, ioctl,
+    msg, sizeof(*msg),
     NULL, 0,
-    cb, data
+    onRequest, REQUEST_USR(request)
   );
 }
 
-static int sendPoll4(ios_cb_t cb, usr_t data) {
-  poll_msg4.device = gcn_adapter_id;
-  DCFlushRange(poll_msg_buffer, sizeof(poll_msg_buffer));
-  return IOS_IoctlAsync(
-    dev_usb_hid_fd, DEV_USB_HID4_IOCTL_INTERRUPT_IN,
-    &poll_msg4, sizeof(poll_msg4),
-    NULL, 0,
-    cb, data
+static int interruptIn4(struct request *request, uint32_t size) {
+  return sendInterrupt4(
+    request, DEV_USB_HID4_IOCTL_INTERRUPT_IN, WUP_028_ENDPOINT_IN, size
   );
 }
 
-static int sendRumble4(ios_cb_t cb, usr_t data) {
-  DCFlushRange(rumble_msg_buffer, 0x20);
-  rumble_msg4.device = gcn_adapter_id;
-  return IOS_IoctlAsync(
-    dev_usb_hid_fd, DEV_USB_HID4_IOCTL_INTERRUPT_OUT,
-    &rumble_msg4, sizeof(rumble_msg4),
-    NULL, 0,
-    cb, data
+static int interruptOut4(struct request *request, uint32_t size) {
+  cacheToDevice(request->buffer, size);
+  return sendInterrupt4(
+    request, DEV_USB_HID4_IOCTL_INTERRUPT_OUT, WUP_028_ENDPOINT_OUT, size
   );
 }
 
+static int deviceChange4(void) {
+  return getDeviceChange4(onDevUsbChange4, NULL);
+}
+static void allocBuffers4(void) {
+  dev_usb_hid4_devices = arenaAlloc(DEV_USB_HID4_DEVICE_CHANGE_SIZE * 4);
+}
+static int initAdapter4(struct adapter *adapter) {
+  return sendInit(adapter);
+}
+
+static const struct backend backend4 = {
+  .get_version = checkVersion4,
+  .on_version = onDevGetVersion4,
+  .alloc = allocBuffers4,
+  .device_change = deviceChange4,
+  .init = initAdapter4,
+  .interrupt_in = interruptIn4,
+  .interrupt_out = interruptOut4
+};
+
 #endif
 
 #ifdef SUPPORT_DEV_USB_HID5
@@ -334,8 +1049,10 @@ static int sendRumble4(ios_cb_t cb, usr_t data) {
 
   /* Size of the DeviceChange ioctl's return (in strctures). */
 # define DEV_USB_HID5_DEVICE_CHANGE_SIZE 0x20
-  /* Total size of all IOS buffers (in words). */
+  /* Size of each adapter's descriptors (in words). */
 # define DEV_USB_HID5_TMP_BUFFER_SIZE 0x20
+  /* Size of the GetVersion ioctl's return. */
+# define DEV_USB_HID5_VERSION_SIZE 0x20
   /* IOCTL numbering for the device. */
 # define DEV_USB_HID5_IOCTL_GET_VERSION 0
 # define DEV_USB_HID5_IOCTL_GET_DEVICE_CHANGE 1
@@ -346,51 +1063,35 @@ static int sendRumble4(ios_cb_t cb, usr_t data) {
   /* Version id. */
 # define DEV_USB_HID5_VERSION 0x00050001
 
-# define OS_IPC_HEAP_HIGH ((void **)0x80003134)
-
-static struct {
+static struct dev_usb_hid5_device {
   uint32_t id;
   uint32_t vid_pid;
   uint32_t _unknown8;
 } *dev_usb_hid5_devices;
-/* This buffer gets managed pretty carefully. During init it's split 0x20 bytes
- * to 0x60 bytes to store the descriptor. The rest of the time it's split
- * evenly, one half for rumble messages and one half for polls. Be careful! */
-static uint32_t *dev_usb_hid5_buffer;
-static ioctlv dev_usb_hid5_argv[2] IOS_ALIGN;
-/* Polls may be sent at the same time as rumbles, so need two ioctlv arrays. */
-static ioctlv dev_usb_hid5_poll_argv[2] IOS_ALIGN;
-
-/* Annoyingly some of the buffers for v5 MUST be in MEM2, so we wrap _start to
- * allocate these before the application boots. */
-void _start(void);
-
-static void my_start(void) {
-  /* Allocate some area in MEM2. */
-  dev_usb_hid5_devices = *OS_IPC_HEAP_HIGH;
-  dev_usb_hid5_devices -= DEV_USB_HID5_DEVICE_CHANGE_SIZE;
-  *OS_IPC_HEAP_HIGH = dev_usb_hid5_devices;
-
-  dev_usb_hid5_buffer = *OS_IPC_HEAP_HIGH;
-  dev_usb_hid5_buffer -= DEV_USB_HID5_TMP_BUFFER_SIZE;
-  *OS_IPC_HEAP_HIGH = dev_usb_hid5_buffer;
-
-  _start();
-}
-
-BSLUG_MUST_REPLACE(_start, my_start);
-
-static void onDevGetVersion5(ios_ret_t ret, usr_t unused);
+/* Output of GetVersion, in the arena. */
+static uint32_t *dev_usb_hid5_version;
+
+  /* Arena needed beyond that for every backend. */
+# define ARENA_SIZE5 ( \
+  DEV_USB_HID5_VERSION_SIZE \
+  + CACHE_ROUND( \
+    sizeof(struct dev_usb_hid5_device) * DEV_USB_HID5_DEVICE_CHANGE_SIZE \
+  ) \
+  + DEV_USB_HID5_TMP_BUFFER_SIZE * 4 * WUP_028_MAX_ADAPTERS \
+)
+
+static void onDevGetVersion5(ios_ret_t ret, usr_t vindex);
 static void onDevUsbAttach5(ios_ret_t ret, usr_t vcount);
 static void onDevUsbChange5(ios_ret_t ret, usr_t unused);
-static void onDevUsbResume5(ios_ret_t ret, usr_t unused);
-static void onDevUsbParams5(ios_ret_t ret, usr_t unused);
+static void onDevUsbResume5(ios_ret_t ret, usr_t vadapter);
+static void onDevUsbParams5(ios_ret_t ret, usr_t vadapter);
 
 static int checkVersion5(ios_cb_t cb, usr_t data) {
+  dev_usb_hid5_version = arenaAlloc(DEV_USB_HID5_VERSION_SIZE);
   return IOS_IoctlAsync(
     dev_usb_hid_fd, DEV_USB_HID5_IOCTL_GET_VERSION,
     NULL, 0,
-    dev_usb_hid5_buffer, 0x20,
+    dev_usb_hid5_version, DEV_USB_HID5_VERSION_SIZE,
     cb, data
   );
 }
@@ -412,71 +1113,408 @@ static int sendAttach5(ios_cb_t cb, usr_t data) {
   );
 }
 
-static int sendResume5(ios_cb_t cb, usr_t data) {
-  dev_usb_hid5_buffer[0] = gcn_adapter_id;
-  dev_usb_hid5_buffer[1] = 0;
-  dev_usb_hid5_buffer[2] = 1;
-  dev_usb_hid5_buffer[3] = 0;
-  dev_usb_hid5_buffer[4] = 0;
-  dev_usb_hid5_buffer[5] = 0;
-  dev_usb_hid5_buffer[6] = 0;
-  dev_usb_hid5_buffer[7] = 0;
+static int sendResume5(struct adapter *adapter, ios_cb_t cb, usr_t data) {
+  uint32_t *buffer = adapter->hid5_buffer;
+  buffer[0] = adapter->id;
+  buffer[1] = 0;
+  buffer[2] = 1;
+  buffer[3] = 0;
+  buffer[4] = 0;
+  buffer[5] = 0;
+  buffer[6] = 0;
+  buffer[7] = 0;
+  cacheToDevice(buffer, 0x20);
   return IOS_IoctlAsync(
     dev_usb_hid_fd, DEV_USB_HID5_IOCTL_SET_RESUME,
-    dev_usb_hid5_buffer, 0x20,
+    buffer, 0x20,
     NULL, 0,
     cb, data
   );
 }
 
-static int sendParams5(ios_cb_t cb, usr_t data) {
+static int sendParams5(struct adapter *adapter, ios_cb_t cb, usr_t data) {
   /* Assumes buffer still in state from sendResume5 */
   return IOS_IoctlAsync(
     dev_usb_hid_fd, DEV_USB_HID5_IOCTL_GET_DEVICE_PARAMETERS,
-    dev_usb_hid5_buffer, 0x20,
-    dev_usb_hid5_buffer + 8, 0x60,
+    adapter->hid5_buffer, 0x20,
+    adapter->hid5_buffer + 8, 0x60,
     cb, data
   );
 }
 
-static int sendInit5(ios_cb_t cb, usr_t data) {
+static int interruptIn5(struct request *request, uint32_t size) {
   /* Assumes buffer already set up */
-  dev_usb_hid5_argv[0] = (ioctlv){dev_usb_hid5_buffer, 0x40};
-  dev_usb_hid5_argv[1] = (ioctlv){init_msg_buffer, sizeof(init_msg_buffer)};
+  ioctlv *argv = request->msg->argv5;
+  argv[0] = (ioctlv){request->adapter->hid5_buffer+0x10, 0x40};
+  argv[1] = (ioctlv){request->buffer, size};
   return IOS_IoctlvAsync(
     dev_usb_hid_fd, DEV_USB_HID5_IOCTL_INTERRUPT,
-    2, 0, dev_usb_hid5_argv,
-    cb, data
+    1, 1, argv,
+    onRequest, REQUEST_USR(request)
   );
 }
 
-static int sendPoll5(ios_cb_t cb, usr_t data) {
+static int interruptOut5(struct request *request, uint32_t size) {
   /* Assumes buffer already set up */
-  dev_usb_hid5_poll_argv[0] = (ioctlv){dev_usb_hid5_buffer+0x10, 0x40};
-  dev_usb_hid5_poll_argv[1] = (ioctlv){poll_msg_buffer, WUP_028_POLL_SIZE};
+  ioctlv *argv = request->msg->argv5;
+  cacheToDevice(request->buffer, size);
+  argv[0] = (ioctlv){request->adapter->hid5_buffer, 0x40};
+  argv[1] = (ioctlv){request->buffer, size};
   return IOS_IoctlvAsync(
     dev_usb_hid_fd, DEV_USB_HID5_IOCTL_INTERRUPT,
-    1, 1, dev_usb_hid5_poll_argv,
-    cb, data
+    2, 0, argv,
+    onRequest, REQUEST_USR(request)
   );
 }
 
-static int sendRumble5(ios_cb_t cb, usr_t data) {
-  /* Assumes buffer already set up */
-  dev_usb_hid5_argv[0] = (ioctlv){dev_usb_hid5_buffer, 0x40};
-  dev_usb_hid5_argv[1] = (ioctlv){rumble_msg_buffer, sizeof(rumble_msg_buffer)};
-  return IOS_IoctlvAsync(
-    dev_usb_hid_fd, DEV_USB_HID5_IOCTL_INTERRUPT,
-    2, 0, dev_usb_hid5_argv,
-    cb, data
+static int deviceChange5(void) {
+  return getDeviceChange5(onDevUsbChange5, NULL);
+}
+static void allocBuffers5(void) {
+  dev_usb_hid5_devices = arenaAlloc(
+    sizeof(dev_usb_hid5_devices[0]) * DEV_USB_HID5_DEVICE_CHANGE_SIZE
   );
+  for (int i = 0; i < WUP_028_MAX_ADAPTERS; i++)
+    adapters[i].hid5_buffer = arenaAlloc(DEV_USB_HID5_TMP_BUFFER_SIZE * 4);
+}
+static int initAdapter5(struct adapter *adapter) {
+  return sendResume5(adapter, onDevUsbResume5, adapter);
 }
 
+static const struct backend backend5 = {
+  .get_version = checkVersion5,
+  .on_version = onDevGetVersion5,
+  .alloc = allocBuffers5,
+  .device_change = deviceChange5,
+  .init = initAdapter5,
+  .interrupt_in = interruptIn5,
+  .interrupt_out = interruptOut5
+};
+
+#endif
+
+/*============================================================================*/
+/* Per-game profiles */
+/*============================================================================*/
+
+#ifdef GEKKO
+# define OS_GAME_ID ((const char *)0x80000000)
+#else
+extern char host_game_id[4];
+# define OS_GAME_ID host_game_id
+#endif
+
+/* Searched in order for the first entry matching the game, so the catch all
+ * must come last. For example, to keep two polls in flight in one game:
+ *   { "RSBE", 2, POLL_IDLE, RUMBLE_DELAY, GCN_TRIGGER_THRESHOLD,
+ *     GCN_TRIGGER_DEAD_ZONE, GCN_STICK_DEAD_ZONE, GCN_STICK_RANGE }, */
+static const struct profile profiles[] = {
+  {
+    "????", POLL_DEPTH, POLL_IDLE, RUMBLE_DELAY, GCN_TRIGGER_THRESHOLD,
+    GCN_TRIGGER_DEAD_ZONE, GCN_STICK_DEAD_ZONE, GCN_STICK_RANGE, 0
+  },
+};
+#define PROFILE_COUNT (sizeof(profiles) / sizeof(profiles[0]))
+
+/* Called once, before the game starts, so nothing after has to look again. */
+static void selectProfile(void) {
+  const struct profile *match = &profiles[PROFILE_COUNT - 1];
+  for (unsigned int i = 0; i < PROFILE_COUNT; i++) {
+    int j;
+    for (j = 0; j < 4; j++)
+      if (
+        profiles[i].game[j] != '?' && profiles[i].game[j] != OS_GAME_ID[j]
+      ) break;
+    if (j == 4) {
+      match = &profiles[i];
+      break;
+    }
+  }
+  profile = *match;
+  /* The pool is only big enough for so many. */
+  if (profile.poll_depth < 1)
+    profile.poll_depth = 1;
+  else if (profile.poll_depth > POLL_DEPTH_MAX)
+    profile.poll_depth = POLL_DEPTH_MAX;
+  /* Calibrated sticks must fit in an int8_t, and stickToFloat divides by it. */
+  if (profile.stick_range < 1)
+    profile.stick_range = 1;
+  else if (profile.stick_range > INT8_MAX)
+    profile.stick_range = INT8_MAX;
+}
+
+/*============================================================================*/
+/* IOS buffer arena */
+/*============================================================================*/
+
+/* The request pool, whichever the backend. */
+#define ARENA_COMMON_SIZE(count) ( \
+  (count) * ( \
+    REQUEST_BUFFER_SIZE + CACHE_ROUND(sizeof(union request_msg)) \
+  ) \
+)
+/* All of it for count requests. The backend isn't known until the game has
+ * booted, so this has to cover whichever needs more. With both backends, two
+ * adapters and a poll depth of 1 it's 2688 bytes of the IPC heap, 1536 of them
+ * v4's device list, and each poll of depth beyond that costs 384 more. */
+#if defined(SUPPORT_DEV_USB_HID4) && defined(SUPPORT_DEV_USB_HID5)
+# define ARENA_SIZE(count) (ARENA_COMMON_SIZE(count) + \
+  (ARENA_SIZE4 > ARENA_SIZE5 ? ARENA_SIZE4 : ARENA_SIZE5))
+#elif defined(SUPPORT_DEV_USB_HID4)
+# define ARENA_SIZE(count) (ARENA_COMMON_SIZE(count) + ARENA_SIZE4)
+#else
+# define ARENA_SIZE(count) (ARENA_COMMON_SIZE(count) + ARENA_SIZE5)
+#endif
+
+#ifdef GEKKO
+# define OS_IPC_HEAP_HIGH ((void **)0x80003134)
+#else
+extern void *host_ipc_heap_high;
+# define OS_IPC_HEAP_HIGH (&host_ipc_heap_high)
+#endif
+
+/* Every buffer IOS reads or writes lives here, in MEM2. Buffers are handed out
+ * afresh each time the interface is opened, once the backend is known. */
+static uint8_t *arena;
+static uint32_t arena_size;
+static uint32_t arena_used;
+
+/* Annoyingly some of the buffers for v5 MUST be in MEM2, so we wrap _start to
+ * take the arena from the IPC heap before the application boots. */
+void _start(void);
+
+static void my_start(void) {
+  selectProfile();
+  request_count = REQUEST_COUNT_FOR(profile.poll_depth);
+  arena_size = ARENA_SIZE(request_count);
+  arena = (uint8_t *)*OS_IPC_HEAP_HIGH - arena_size;
+  arena -= (uint32_t)arena & 0x1f;
+  *OS_IPC_HEAP_HIGH = arena;
+#ifdef CAPTURE_RING
+  wup028_capture.reports = (WUP028Report_t *)arena - WUP028Capture_SIZE;
+  *OS_IPC_HEAP_HIGH = wup028_capture.reports;
+#endif
+
+  _start();
+}
+
+BSLUG_MUST_REPLACE(_start, my_start);
+
+/* Sizes are rounded up to whole cache lines so no two buffers share a line,
+ * and flushing or invalidating one never disturbs another. */
+static void *arenaAlloc(uint32_t size) {
+  void *result = arena + arena_used;
+  arena_used += CACHE_ROUND(size);
+  return result;
+}
+
+/* Takes every buffer the chosen backend needs from the arena, and with them
+ * builds the request pool afresh. Anything still in flight from before is
+ * dropped when it completes. */
+static int allocBuffers(void) {
+  requests_free = NULL;
+  for (int i = request_count - 1; i >= 0; i--) {
+    struct request *request = &requests[i];
+    request->buffer = arenaAlloc(REQUEST_BUFFER_SIZE);
+    request->msg = arenaAlloc(sizeof(union request_msg));
+    /* The tag carries on, so old completions can't match new requests. */
+    request->done = NULL;
+    request->next = requests_free;
+    requests_free = request;
+  }
+  for (int i = 0; i < WUP_028_MAX_ADAPTERS; i++) {
+    adapters[i].polls_in_flight = 0;
+    adapters[i].rumble = NULL;
+  }
+  backend->alloc();
+  if (arena_used > arena_size)
+    return -1;
+
+  /* Drop anything left over in the cache, which could otherwise be written
+   * back on top of a report. The CPU only writes these again just before
+   * flushing them out. */
+  for (int i = 0; i < request_count; i++)
+    cacheFromDevice(requests[i].buffer, REQUEST_BUFFER_SIZE);
+  return 0;
+}
+
+/* Takes a request from the pool for done to be called on. Called from
+ * callbacks, or with interrupts disabled. */
+static struct request *requestAlloc(
+  struct adapter *adapter, void (*done)(struct request *request, ios_ret_t ret)
+) {
+  struct request *request = requests_free;
+  if (!request) {
+    wup028_counters.requests_exhausted++;
+    return NULL;
+  }
+  requests_free = request->next;
+  request->adapter = adapter;
+  request->done = done;
+  request->sent = mftb();
+  request->tag++;
+  request->abandoned = 0;
+  return request;
+}
+
+static void requestFree(struct request *request) {
+  request->done = NULL;
+  request->next = requests_free;
+  requests_free = request;
+}
+
+/* Every request from the pool completes here, and is passed on to whatever it
+ * was taken for. */
+static void onRequest(ios_ret_t ret, usr_t vrequest) {
+  uint32_t usr = (uint32_t)vrequest;
+  struct request *request = &requests[usr >> 8];
+  /* Sent before the pool was last rebuilt. */
+  if (!request->done || (uint8_t)usr != request->tag) return;
+  MASKED_TIME(masked);
+  if (request->abandoned) {
+    /* Already replaced by the watchdog, or its adapter was forgotten. */
+    if (request->done == onDevUsbPoll)
+      wup028_counters.polls_stale++;
+  } else
+    request->done(request, ret);
+  requestFree(request);
+  /* IOS runs every callback with interrupts disabled. */
+  MASKED_DONE(callback, masked);
+}
+
+/* Backends in the order to try them. */
+static const struct backend *const backends[] = {
+#ifdef SUPPORT_DEV_USB_HID4
+  &backend4,
+#endif
+#ifdef SUPPORT_DEV_USB_HID5
+  &backend5,
 #endif
+};
+#define BACKEND_COUNT (sizeof(backends) / sizeof(backends[0]))
+
+/* Checks the version for backends[index], or returns fail if there are no more
+ * backends to try. */
+static int probeBackend(unsigned int index, int fail) {
+  if (index >= BACKEND_COUNT)
+    return fail;
+  return backends[index]->get_version(
+    backends[index]->on_version, (usr_t)index
+  );
+}
+
+/* Records the device at position index of a device change, returning 1 if it
+ * differs from what was there last time. */
+static int updateDevice(int index, uint32_t id, int is_adapter) {
+  if (index < device_count && device_ids[index] == id)
+    return 0;
+  device_ids[index] = id;
+  if (is_adapter)
+    device_adapters |= 1u << index;
+  else
+    device_adapters &= ~(1u << index);
+  return 1;
+}
+
+/* Brings adapters in line with the first count entries of device_ids after a
+ * device change. Adapters which are gone are forgotten, and new ones are given
+ * a free entry and initialised. */
+static void updateAdapters(int count) {
+  device_count = count;
+  if (count < DEVICE_LIST_SIZE)
+    device_adapters &= (1u << count) - 1;
+  uint32_t unclaimed = device_adapters;
+  for (int i = 0; i < WUP_028_MAX_ADAPTERS; i++) {
+    struct adapter *adapter = &adapters[i];
+    if (adapter->id == (uint32_t)-1) continue;
+    /* Usually it hasn't moved. */
+    if (
+      !((unclaimed >> adapter->slot) & 1)
+      || device_ids[adapter->slot] != adapter->id
+    ) {
+      uint32_t search = unclaimed;
+      adapter->slot = DEVICE_LIST_SIZE;
+      while (search) {
+        int slot = __builtin_ctz(search);
+        search &= search - 1;
+        if (device_ids[slot] == adapter->id) {
+          adapter->slot = slot;
+          break;
+        }
+      }
+      if (adapter->slot == DEVICE_LIST_SIZE) {
+        forgetAdapter(adapter);
+        continue;
+      }
+    }
+    unclaimed &= ~(1u << adapter->slot);
+  }
+  for (int i = 0; i < WUP_028_MAX_ADAPTERS && unclaimed; i++) {
+    struct adapter *spare = &adapters[i];
+    if (spare->id != (uint32_t)-1) continue;
+    spare->slot = __builtin_ctz(unclaimed);
+    unclaimed &= unclaimed - 1;
+    spare->id = device_ids[spare->slot];
+    spare->calibrated = 0;
+    spare->poll_time = mftb();
+    spare->watchdog_strikes = 0;
+    spare->initialised = 0;
+    spare->polls_in_flight = 0;
+    spare->rumble = NULL;
+    spare->idle = 0;
+    spare->rumble_power = 0;
+    /* Should this fail, the watchdog initialises it again. */
+    backend->init(spare);
+  }
+}
+
+static void setError(ios_ret_t ret, int8_t method) {
+  error = ret;
+  errorMethod = method;
+  wup028_counters.errors[method]++;
+}
+
+static void scheduleReconnect(void) {
+  /* Every adapter is claimed afresh on reopening. */
+  for (int i = 0; i < WUP_028_MAX_ADAPTERS; i++)
+    if (adapters[i].id != (uint32_t)-1)
+      forgetAdapter(&adapters[i]);
+  reconnect_time = mftb() + reconnect_delay;
+  reconnect_delay *= 2;
+  if (reconnect_delay > RECONNECT_DELAY_MAX)
+    reconnect_delay = RECONNECT_DELAY_MAX;
+  reconnect = 1;
+}
 
 static void onError(void) {
+  /* Requests cancelled by the close fail too; only the first error counts. */
+  if (dev_usb_hid_fd < 0) return;
+  ios_fd_t fd = dev_usb_hid_fd;
   dev_usb_hid_fd = -1;
-  IOS_CloseAsync(dev_usb_hid_fd, callbackIgnore, NULL);
+  if (IOS_CloseAsync(fd, onDevClose, NULL))
+    scheduleReconnect();
+}
+
+/* Records an error on one adapter. It stays claimed, so with no polls
+ * completing the watchdog retries it and then initialises it again. */
+static void failAdapter(struct adapter *adapter, ios_ret_t ret, int8_t method) {
+  (void)adapter;
+  setError(ret, method);
+  if (ret == REQUEST_POOL_EMPTY)
+    /* Requests IOS never completed are only given back by closing. */
+    onError();
+}
+
+/* Opens /dev/usb/hid from the game's thread. Should IOS not even take the
+ * request, e.g. for want of IPC heap, onDevOpen never runs, so the retry is
+ * scheduled here instead. */
+static int openDevice(void) {
+  int ret = IOS_OpenAsync(DEV_USB_HID_PATH, 0, onDevOpen, NULL);
+  if (ret < 0) {
+    setError(ret, 1);
+    scheduleReconnect();
+  }
+  return ret;
 }
 
 /*============================================================================*/
@@ -488,65 +1526,58 @@ static void onDevOpen(ios_fd_t fd, usr_t unused) {
   int ret;
   (void)unused;
   dev_usb_hid_fd = fd;
+  device_count = 0;
+  arena_used = 0;
   if (fd >= 0)
-    ret =
-#if defined(SUPPORT_DEV_USB_HID4)
-      checkVersion4(onDevGetVersion4, NULL);
-#elif defined(SUPPORT_DEV_USB_HID5)
-      checkVersion5(onDevGetVersion5, NULL);
-#else
-      -1;
-#endif
+    ret = probeBackend(0, -1);
   else
     ret = fd;
   if (ret) {
-    error = ret;
-    errorMethod = 1;
+    setError(ret, 1);
+    if (fd >= 0)
+      onError();
+    else
+      scheduleReconnect();
   }
 }
 
-static void callbackIgnore(ios_ret_t ret, usr_t unused) {
+static void onDevClose(ios_ret_t ret, usr_t unused) {
   (void)unused;
   (void)ret;
+  scheduleReconnect();
 }
 
 #ifdef SUPPORT_DEV_USB_HID4
-static void onDevGetVersion4(ios_ret_t ret, usr_t unused) {
-  (void)unused;
+static void onDevGetVersion4(ios_ret_t ret, usr_t vindex) {
   if (ret == DEV_USB_HID4_VERSION) {
-#ifdef HAVE_VERSION
-    version = 4;
-#endif
-    ret = getDeviceChange4(onDevUsbChange4, NULL);
+    backend = &backend4;
+    ret = allocBuffers();
+    if (ret == 0)
+      ret = backend->device_change();
   } else
-    ret =
-#ifdef SUPPORT_DEV_USB_HID5
-      checkVersion5(onDevGetVersion5, NULL);
-#else
-      ret;
-#endif
+    ret = probeBackend((unsigned int)vindex + 1, ret);
   if (ret) {
-    error = ret;
-    errorMethod = 2;
+    setError(ret, 2);
     onError();
   }
 }
 #endif
 
 #ifdef SUPPORT_DEV_USB_HID5
-static void onDevGetVersion5(ios_ret_t ret, usr_t unused) {
-  (void)unused;
-  if (ret == 0 && dev_usb_hid5_buffer[0] == DEV_USB_HID5_VERSION) {
-#ifdef HAVE_VERSION
-    version = 5;
-#endif
-    ret = getDeviceChange5(onDevUsbChange5, NULL);
-  } else if (ret == 0)
-    ret = dev_usb_hid5_buffer[0];
+static void onDevGetVersion5(ios_ret_t ret, usr_t vindex) {
+  if (ret == 0 && dev_usb_hid5_version[0] == DEV_USB_HID5_VERSION) {
+    backend = &backend5;
+    ret = allocBuffers();
+    if (ret == 0)
+      ret = backend->device_change();
+  } else {
+    if (ret == 0)
+      ret = dev_usb_hid5_version[0];
+    ret = probeBackend((unsigned int)vindex + 1, ret);
+  }
 
   if (ret) {
-    error = ret;
-    errorMethod = 3;
+    setError(ret, 3);
     onError();
   }
 }
@@ -555,27 +1586,28 @@ static void onDevGetVersion5(ios_ret_t ret, usr_t unused) {
 #ifdef SUPPORT_DEV_USB_HID4
 static void onDevUsbChange4(ios_ret_t ret, usr_t unused) {
   if (ret >= 0) {
-    int found = 0;
-    for (int i = 0; i < DEV_USB_HID4_DEVICE_CHANGE_SIZE && dev_usb_hid4_devices[i] < sizeof(dev_usb_hid4_devices); i += dev_usb_hid4_devices[i] / 4) {
-      uint32_t device_id = dev_usb_hid4_devices[i + 1];
-      if (
+    int changed = 0;
+    int count = 0;
+    for (
+      int i = 0;
+      i < DEV_USB_HID4_DEVICE_CHANGE_SIZE
+      && dev_usb_hid4_devices[i] < DEV_USB_HID4_DEVICE_CHANGE_SIZE * 4
+      && count < DEVICE_LIST_SIZE;
+      i += dev_usb_hid4_devices[i] / 4
+    ) {
+      changed |= updateDevice(
+        count++, dev_usb_hid4_devices[i + 1],
         dev_usb_hid4_devices[i] == WUP_028_DESCRIPTOR_SIZE
         && dev_usb_hid4_devices[i + 4] == WUP_028_ID
-      ) {
-        found = 1;
-        if (gcn_adapter_id != device_id) {
-          gcn_adapter_id = device_id;
-          sendInit4(onDevUsbInit, NULL);
-        }
-        break;
-      }
+      );
     }
-    if (!found) gcn_adapter_id = (uint32_t)-1;
-    ret = getDeviceChange4(onDevUsbChange4, NULL);
+    if (changed || count != device_count)
+      updateAdapters(count);
+    reconnect_delay = RECONNECT_DELAY_INITIAL;
+    ret = backend->device_change();
   }
   if (ret) {
-    error = ret;
-    errorMethod = 5;
+    setError(ret, 5);
     onError();
   }
 }
@@ -587,8 +1619,7 @@ static void onDevUsbChange5(ios_ret_t ret, usr_t unused) {
     ret = sendAttach5(onDevUsbAttach5, (usr_t)ret);
   }
   if (ret) {
-    error = ret;
-    errorMethod = 4;
+    setError(ret, 4);
     onError();
   }
 }
@@ -597,185 +1628,594 @@ static void onDevUsbChange5(ios_ret_t ret, usr_t unused) {
 #ifdef SUPPORT_DEV_USB_HID5
 static void onDevUsbAttach5(ios_ret_t ret, usr_t vcount) {
   if (ret == 0) {
-    int found = 0;
+    int changed = 0;
     int count = (int)vcount;
-    for (int i = 0; i < DEV_USB_HID5_DEVICE_CHANGE_SIZE && i < count; i++) {
-      uint32_t device_id = dev_usb_hid5_devices[i].id;
-      if (dev_usb_hid5_devices[i].vid_pid == WUP_028_ID) {
-        found = 1;
-        if (gcn_adapter_id != device_id) {
-          gcn_adapter_id = device_id;
-
-          if (sendResume5(onDevUsbResume5, NULL))
-            found = 0;
-        }
-        break;
-      }
+    if (count > DEV_USB_HID5_DEVICE_CHANGE_SIZE)
+      count = DEV_USB_HID5_DEVICE_CHANGE_SIZE;
+    for (int i = 0; i < count; i++) {
+      changed |= updateDevice(
+        i, dev_usb_hid5_devices[i].id,
+        dev_usb_hid5_devices[i].vid_pid == WUP_028_ID
+      );
     }
-    if (!found) gcn_adapter_id = (uint32_t)-1;
-    ret = getDeviceChange5(onDevUsbChange5, NULL);
+    if (changed || count != device_count)
+      updateAdapters(count);
+    reconnect_delay = RECONNECT_DELAY_INITIAL;
+    ret = backend->device_change();
   }
   if (ret) {
-    error = ret;
-    errorMethod = 5;
+    setError(ret, 5);
     onError();
   }
 }
 #endif
 
 #ifdef SUPPORT_DEV_USB_HID5
-static void onDevUsbResume5(ios_ret_t ret, usr_t unused) {
+static void onDevUsbResume5(ios_ret_t ret, usr_t vadapter) {
+  struct adapter *adapter = vadapter;
   if (ret == 0) {
-    ret = sendParams5(onDevUsbParams5, NULL);
-  }
-  if (ret) {
-    error = ret;
-    errorMethod = 6;
-    gcn_adapter_id = -1;
+    ret = sendParams5(adapter, onDevUsbParams5, adapter);
   }
+  if (ret)
+    failAdapter(adapter, ret, 6);
 }
 #endif
 
 #ifdef SUPPORT_DEV_USB_HID5
-static void onDevUsbParams5(ios_ret_t ret, usr_t unused) {
+static void onDevUsbParams5(ios_ret_t ret, usr_t vadapter) {
+  struct adapter *adapter = vadapter;
   if (ret == 0) {
+    uint32_t *buffer = adapter->hid5_buffer;
     /* 0-7 are already correct :) */
-    dev_usb_hid5_buffer[8] = 0;
-    dev_usb_hid5_buffer[9] = 0;
-    dev_usb_hid5_buffer[10] = 0;
-    dev_usb_hid5_buffer[11] = 0;
-    dev_usb_hid5_buffer[12] = 0;
-    dev_usb_hid5_buffer[13] = 0;
-    dev_usb_hid5_buffer[14] = 0;
-    dev_usb_hid5_buffer[15] = 0;
-    dev_usb_hid5_buffer[16] = gcn_adapter_id;
-    dev_usb_hid5_buffer[17] = 0;
-    dev_usb_hid5_buffer[18] = 0;
-    dev_usb_hid5_buffer[19] = 0;
-    dev_usb_hid5_buffer[20] = 0;
-    dev_usb_hid5_buffer[21] = 0;
-    dev_usb_hid5_buffer[22] = 0;
-    dev_usb_hid5_buffer[23] = 0;
-    dev_usb_hid5_buffer[24] = 0;
-    dev_usb_hid5_buffer[25] = 0;
-    dev_usb_hid5_buffer[26] = 0;
-    dev_usb_hid5_buffer[27] = 0;
-    dev_usb_hid5_buffer[28] = 0;
-    dev_usb_hid5_buffer[29] = 0;
-    dev_usb_hid5_buffer[30] = 0;
-    dev_usb_hid5_buffer[31] = 0;
-    ret = sendInit5(onDevUsbInit, NULL);
+    buffer[8] = 0;
+    buffer[9] = 0;
+    buffer[10] = 0;
+    buffer[11] = 0;
+    buffer[12] = 0;
+    buffer[13] = 0;
+    buffer[14] = 0;
+    buffer[15] = 0;
+    buffer[16] = adapter->id;
+    buffer[17] = 0;
+    buffer[18] = 0;
+    buffer[19] = 0;
+    buffer[20] = 0;
+    buffer[21] = 0;
+    buffer[22] = 0;
+    buffer[23] = 0;
+    buffer[24] = 0;
+    buffer[25] = 0;
+    buffer[26] = 0;
+    buffer[27] = 0;
+    buffer[28] = 0;
+    buffer[29] = 0;
+    buffer[30] = 0;
+    buffer[31] = 0;
+    cacheToDevice(buffer + 8, 0x60);
+    ret = sendInit(adapter);
   }
-  if (ret) {
-    error = ret;
-    errorMethod = 7;
-    gcn_adapter_id = -1;
+  if (ret)
+    failAdapter(adapter, ret, 7);
+}
+#endif
+
+static void onRumble(struct request *rumble, ios_ret_t ret) {
+  struct adapter *adapter = rumble->adapter;
+  /* Unless it already timed out. */
+  if (rumble == adapter->rumble)
+    adapter->rumble = NULL;
+  if (ret >= 0) {
+    /* Moving average of the round trip time. Rumbles that timed out count
+     * too, or a round trip longer than the timeout would never be learnt. */
+    uint32_t rtt = mftb() - rumble->sent;
+    if (rtt > RUMBLE_RTT_MAX)
+      rtt = RUMBLE_RTT_MAX;
+    adapter->rumble_rtt += (int32_t)(rtt - adapter->rumble_rtt) / 8;
+#ifdef PROBE_LATENCY
+    if (probe_stage == PROBE_SENT && rumble == probe_request) {
+      wup028_probe.rumble = mftb();
+      probeRecord(
+        &wup028_probe.to_rumble, wup028_probe.rumble - wup028_probe.report
+      );
+      /* probeRead puts the motor back, as only the game's thread makes
+       * rumble requests. */
+      probe_stage = PROBE_DONE;
+    }
+#endif
   }
 }
+
+/* Takes a rumble to send, if one is pending and the last has finished. Called
+ * from callbacks, or with interrupts disabled. */
+static struct request *takeRumble(struct adapter *adapter) {
+  if (!adapter->rumble_dirty.any || !adapter->rumble_power) return NULL;
+  if (
+    adapter->rumble
+    && mftb() - adapter->rumble->sent
+      > adapter->rumble_rtt * profile.rumble_delay
+  ) {
+    wup028_counters.rumble_timeouts++;
+    /* Goes back to the pool if it ever completes. */
+    adapter->rumble = NULL;
+  }
+  if (adapter->rumble) return NULL;
+  struct request *rumble = requestAlloc(adapter, onRumble);
+  if (!rumble) return NULL;
+  /* Callbacks can't be interrupted by the game's thread, so the outputs can't
+   * change between clearing the mask and copying them. */
+  adapter->rumble_dirty.any = 0;
+  rumble->buffer[0] = WUP_028_CMD_RUMBLE;
+  for (int i = 0; i < GCN_CONTROLLER_COUNT; i++)
+    rumble->buffer[i + 1] = adapter->rumble_buffer[i];
+  adapter->rumble = rumble;
+#ifdef PROBE_LATENCY
+  if (
+    probe_stage == PROBE_RUMBLE && adapter == &adapters[0]
+    && rumble->buffer[probe_port + 1]
+  ) {
+    probe_request = rumble;
+    probe_stage = PROBE_SENT;
+  }
 #endif
+  return rumble;
+}
 
-static void onRumble(ios_ret_t ret, usr_t token) {
-  (void)ret;
-  uint32_t isr = cpu_isr_disable();
-  if ((usr_t)(uint32_t)rumble_token == token)
-    rumble_delay = 0;
-  cpu_isr_restore(isr);
+/* Takes a poll to send. Called from callbacks, or with interrupts disabled. */
+static struct request *takePoll(struct adapter *adapter) {
+  struct request *poll = requestAlloc(adapter, onDevUsbPoll);
+  if (!poll) return NULL;
+  poll->order = ++adapter->poll_order;
+  adapter->polls_in_flight++;
+  wup028_counters.polls_sent++;
+  return poll;
 }
 
-static int sendPoll(void) {
-  if (rumble_sent != rumble_recv) {
+/* Sends what takeRumble and takePoll took, either of which may be NULL. Unless
+ * a send fails this touches nothing callbacks do, so the game's thread calls it
+ * with interrupts enabled. */
+static int sendTaken(
+  struct adapter *adapter, struct request *rumble, struct request *poll
+) {
+  if (rumble && backend->interrupt_out(rumble, WUP_028_RUMBLE_SIZE)) {
+    /* Try again with the next poll. */
     uint32_t isr = cpu_isr_disable();
-    if (rumble_delay == 0) {
+    MASKED_TIME(masked);
+    /* Unless a callback forgot the adapter in the meantime. */
+    if (!rumble->abandoned) {
+      adapter->rumble = NULL;
       for (int i = 0; i < GCN_CONTROLLER_COUNT; i++)
-        rumble_msg_buffer[i + 1] = rumble_buffer[rumble_recv][i];
-      rumble_recv = (rumble_recv + 1) % RUMBLE_BUFFER;
-      rumble_delay = RUMBLE_DELAY;
-      rumble_token++;
-    } else
-      rumble_delay--;
+        adapter->rumble_dirty.pad[i] = 1;
+    }
+    requestFree(rumble);
+    MASKED_DONE(send, masked);
+    cpu_isr_restore(isr);
+  }
+  if (!poll)
+    return REQUEST_POOL_EMPTY;
+  int ret = backend->interrupt_in(poll, WUP_028_POLL_SIZE);
+  if (ret) {
+    uint32_t isr = cpu_isr_disable();
+    MASKED_TIME(masked);
+    /* Likewise, or by the watchdog, which has already recounted. */
+    if (!poll->abandoned)
+      adapter->polls_in_flight--;
+    wup028_counters.polls_sent--;
+    requestFree(poll);
+    MASKED_DONE(send, masked);
     cpu_isr_restore(isr);
+  }
+  return ret;
+}
 
-#ifdef SUPPORT_DEV_USB_HID5
-#ifdef HAVE_VERSION
-    if (version == 5)
-#endif
-    sendRumble5(onRumble, (usr_t)(uint32_t)rumble_token);
-#endif
-#ifdef SUPPORT_DEV_USB_HID4
-#ifdef HAVE_VERSION
-    if (version == 4)
-#endif
-    sendRumble4(onRumble, (usr_t)(uint32_t)rumble_token);
+/* Sends a poll, and any pending rumble ahead of it. Called from callbacks. */
+static int sendPoll(struct adapter *adapter) {
+  struct request *rumble = takeRumble(adapter);
+  return sendTaken(adapter, rumble, takePoll(adapter));
+}
+
+/* Sends polls until the profile's depth are in flight. */
+static int fillPolls(struct adapter *adapter) {
+  int ret = 0;
+  while (!ret && adapter->polls_in_flight < profile.poll_depth)
+    ret = sendPoll(adapter);
+  return ret;
+}
+
+#ifdef POLL_SCHEDULE
+/* Decides whether a poll which has just completed should be sent again, filling
+ * the pipeline if the game is about to read. */
+static int schedulePoll(struct adapter *adapter, struct request *poll) {
+  uint32_t now = mftb();
+  uint32_t rtt = now - poll->sent;
+  adapter->poll_rtt += (int32_t)(rtt - adapter->poll_rtt) / 8;
+  /* A poll sent within this long of the next read will be the one it sees. */
+  int32_t lead = 2 * adapter->poll_rtt;
+  int32_t until = read_schedule.last + read_schedule.period - now;
+  if (until < lead)
+    return fillPolls(adapter);
+  if (adapter->polls_in_flight)
+    return 0;
+  /* Always keep one poll going. */
+  return sendPoll(adapter);
+}
 #endif
+
+/* Records an error on one adapter from the game's thread. */
+static void failAdapterLater(
+  struct adapter *adapter, ios_ret_t ret, int8_t method
+) {
+  uint32_t isr = cpu_isr_disable();
+  failAdapter(adapter, ret, method);
+  cpu_isr_restore(isr);
+}
+
+/* Sends the next poll of an idle adapter once it's due. */
+static void idlePoll(struct adapter *adapter) {
+  if (!adapter->idle || (int32_t)(mftb() - adapter->idle_time) < 0) return;
+  struct request *rumble = NULL;
+  struct request *poll = NULL;
+  int due = 0;
+  uint32_t isr = cpu_isr_disable();
+  MASKED_TIME(masked);
+  /* Check again now that no callback can run. */
+  if (
+    adapter->idle
+    && adapter->id != (uint32_t)-1
+    && (int32_t)(mftb() - adapter->idle_time) >= 0
+    && !adapter->polls_in_flight
+  ) {
+    /* Nothing was outstanding, so the watchdog counts from now. */
+    adapter->poll_time = mftb();
+    adapter->idle_time = adapter->poll_time + profile.poll_idle ms;
+    rumble = takeRumble(adapter);
+    poll = takePoll(adapter);
+    due = 1;
+  }
+  MASKED_DONE(idle_poll, masked);
+  cpu_isr_restore(isr);
+  if (due) {
+    int ret = sendTaken(adapter, rumble, poll);
+    if (ret)
+      failAdapterLater(adapter, ret, 9);
   }
-#ifdef SUPPORT_DEV_USB_HID5
-#ifdef HAVE_VERSION
-  if (version == 5)
-#endif
-  return sendPoll5(onDevUsbPoll, NULL);
-#endif
-#ifdef SUPPORT_DEV_USB_HID4
-#ifdef HAVE_VERSION
-  if (version == 4)
-#endif
-  return sendPoll4(onDevUsbPoll, NULL);
-#endif
-  return -1;
 }
 
-static void onDevUsbInit(ios_ret_t ret, usr_t unused) {
-  if (ret >= 0) {
-    ret = sendPoll();
+/* Restarts an adapter whose polls have stopped completing. */
+static void watchdog(struct adapter *adapter) {
+  if (
+    adapter->id == (uint32_t)-1
+    || mftb() - adapter->poll_time < POLL_WATCHDOG
+  ) return;
+  struct request *rumble = NULL;
+  struct request *poll = NULL;
+  enum {
+    WATCHDOG_NONE, WATCHDOG_POLL, WATCHDOG_SEND_INIT, WATCHDOG_INIT
+  } action = WATCHDOG_NONE;
+  uint32_t isr = cpu_isr_disable();
+  MASKED_TIME(masked);
+  /* Check again now that no callback can run. */
+  if (
+    adapter->id != (uint32_t)-1
+    && mftb() - adapter->poll_time >= POLL_WATCHDOG
+  ) {
+    adapter->poll_time = mftb();
+    for (int i = 0; i < request_count; i++)
+      if (requests[i].adapter == adapter && requests[i].done == onDevUsbPoll)
+        requests[i].abandoned = 1;
+    adapter->polls_in_flight = 0;
+    uint8_t strikes = adapter->watchdog_strikes++;
+    if (strikes == 0 && !adapter->initialised) {
+      /* Polls aren't answered until the init is, so resend just that. */
+      wup028_counters.watchdog_inits++;
+      action = WATCHDOG_SEND_INIT;
+    } else if (strikes == 0) {
+      wup028_counters.watchdog_polls++;
+      /* Just the one. The rest of the pipeline is sent as it completes. */
+      rumble = takeRumble(adapter);
+      poll = takePoll(adapter);
+      action = WATCHDOG_POLL;
+    } else {
+      wup028_counters.watchdog_inits++;
+      adapter->initialised = 0;
+      action = WATCHDOG_INIT;
+    }
   }
+  MASKED_DONE(watchdog, masked);
+  cpu_isr_restore(isr);
+  int ret = 0;
+  if (action == WATCHDOG_POLL)
+    ret = sendTaken(adapter, rumble, poll);
+  else if (action == WATCHDOG_SEND_INIT)
+    ret = sendInit(adapter);
+  else if (action == WATCHDOG_INIT)
+    ret = backend->init(adapter);
+  if (ret)
+    failAdapterLater(adapter, ret, 10);
+}
+
+/* Called from callbacks, or from the game's thread by the watchdog, so unlike
+ * the rest this takes its request with interrupts disabled. It's rare enough
+ * for that not to matter. */
+static int sendInit(struct adapter *adapter) {
+  uint32_t isr = cpu_isr_disable();
+  MASKED_TIME(masked);
+  struct request *init = requestAlloc(adapter, onDevUsbInit);
+  MASKED_DONE(send, masked);
+  cpu_isr_restore(isr);
+  if (!init)
+    return REQUEST_POOL_EMPTY;
+  init->buffer[0] = WUP_028_CMD_INIT;
+  int ret = backend->interrupt_out(init, WUP_028_INIT_SIZE);
   if (ret) {
-    error = ret;
-    errorMethod = 8;
-    gcn_adapter_id = -1;
+    isr = cpu_isr_disable();
+    MASKED_TIME(masked_free);
+    requestFree(init);
+    MASKED_DONE(send, masked_free);
+    cpu_isr_restore(isr);
   }
+  return ret;
 }
 
-static void onDevUsbPoll(ios_ret_t ret, usr_t unused) {
+static void onDevUsbInit(struct request *init, ios_ret_t ret) {
+  struct adapter *adapter = init->adapter;
   if (ret >= 0) {
-    if (poll_msg_buffer[0] == 0x21) {
-      uint32_t isr = cpu_isr_disable();
-      for (int i = 0; i < GCN_CONTROLLER_COUNT; i++) {
-        uint8_t *data = poll_msg_buffer + (i * 9 + 1);
-        if ((data[0] >> 4) != 1 && (data[0] >> 4) != 2) {
-          gcn_data[i].error = PADData_ERROR_NO_CONNECTION;
-          continue;
-        }
-        gcn_data[i].buttons =
-          ((data[1] >> 0) & 1 ? PADData_BUTTON_A : 0) |
-          ((data[1] >> 1) & 1 ? PADData_BUTTON_B : 0) |
-          ((data[1] >> 2) & 1 ? PADData_BUTTON_X : 0) |
-          ((data[1] >> 3) & 1 ? PADData_BUTTON_Y : 0) |
-          ((data[1] >> 4) & 1 ? PADData_BUTTON_DL : 0) |
-          ((data[1] >> 5) & 1 ? PADData_BUTTON_DR : 0) |
-          ((data[1] >> 6) & 1 ? PADData_BUTTON_DD : 0) |
-          ((data[1] >> 7) & 1 ? PADData_BUTTON_DU : 0) |
-          ((data[2] >> 0) & 1 ? PADData_BUTTON_S : 0) |
-          ((data[2] >> 1) & 1 ? PADData_BUTTON_Z : 0) |
-          (data[7] >= GCN_TRIGGER_THRESHOLD ? PADData_BUTTON_L : 0) |
-          (data[8] >= GCN_TRIGGER_THRESHOLD ? PADData_BUTTON_R : 0);
-        gcn_data[i].aStickX = data[3] - 128;
-        gcn_data[i].aStickY = data[4] - 128;
-        gcn_data[i].cStickX = data[5] - 128;
-        gcn_data[i].cStickY = data[6] - 128;
-        gcn_data[i].sliderL = data[7];
-        gcn_data[i].sliderR = data[8];
-        gcn_data[i]._unknown8 = 0;
-        gcn_data[i]._unknown9 = 0;
-        gcn_data[i].error = 0;
-      }
-      gcn_data_written = mftb();
-      cpu_isr_restore(isr);
-    }
-    ret = sendPoll();
+    adapter->initialised = 1;
+    /* Fill the pipeline. Polls still in flight from before a reconnect count
+     * towards it, and rejoin it when they complete. */
+    ret = fillPolls(adapter);
   }
-  if (ret) {
-    error = ret;
-    errorMethod = 9;
-    gcn_adapter_id = -1;
+  if (ret)
+    failAdapter(adapter, ret, 8);
+}
+
+static void decodeInit(void) {
+  static const uint16_t buttons1[8] = {
+    PADData_BUTTON_A, PADData_BUTTON_B, PADData_BUTTON_X, PADData_BUTTON_Y,
+    PADData_BUTTON_DL, PADData_BUTTON_DR, PADData_BUTTON_DD, PADData_BUTTON_DU
+  };
+  for (int i = 0; i < 256; i++) {
+    uint16_t buttons = 0;
+    for (int bit = 0; bit < 8; bit++)
+      if ((i >> bit) & 1)
+        buttons |= buttons1[bit];
+    decode_buttons1[i] = buttons;
+    decode_buttons2[i] =
+      (i & 1 ? PADData_BUTTON_S : 0) |
+      (i & 2 ? PADData_BUTTON_Z : 0);
+    decode_trigger[i] =
+      i >= profile.trigger_threshold ? PADData_BUTTON_L : 0;
+    decode_slider[i] = i <= profile.trigger_dead_zone ? 0 :
+      (i - profile.trigger_dead_zone) * 255 / (255 - profile.trigger_dead_zone);
   }
 }
 
+static void calibrate(struct calibration *calibration, const uint8_t *data) {
+  /* The sticks are assumed to be at rest when the controller is connected,
+   * just as a real GameCube treats them. */
+  for (int axis = 0; axis < 4; axis++) {
+    int origin = data[3 + axis];
+    for (int i = 0; i < 256; i++) {
+      int value = i - origin;
+      int dead_zone = profile.stick_dead_zone;
+      if (value >= -dead_zone && value <= dead_zone)
+        value = 0;
+      else if (value > profile.stick_range)
+        value = profile.stick_range;
+      else if (value < -profile.stick_range)
+        value = -profile.stick_range;
+      calibration->stick[axis][i] = value;
+    }
+  }
+}
+
+static struct gcn_state *gcnStateBegin(struct adapter *adapter) {
+  /* Called from callbacks only. Pick the slot not in use by either side. */
+  uint8_t slot = 0;
+  while (slot == adapter->published || slot == adapter->reading)
+    slot++;
+  return &adapter->state[slot];
+}
+static void gcnStatePublish(struct adapter *adapter, struct gcn_state *state) {
+  state->seq = adapter->state[adapter->published].seq + 1;
+  compiler_barrier();
+  adapter->published = state - adapter->state;
+}
+
+/* Reports the adapter's controllers as disconnected straight away, rather than
+ * once GCN_TIMEOUT has passed, and stops polling it. */
+static void forgetAdapter(struct adapter *adapter) {
+  struct gcn_state *state = gcnStateBegin(adapter);
+  adapter->id = (uint32_t)-1;
+  /* The entry may be claimed by another device before these complete. */
+  for (int i = 0; i < request_count; i++)
+    if (requests[i].adapter == adapter && requests[i].done)
+      requests[i].abandoned = 1;
+  adapter->polls_in_flight = 0;
+  adapter->rumble = NULL;
+  for (int i = 0; i < GCN_CONTROLLER_COUNT; i++)
+    state->data[i].error = PADData_ERROR_NO_CONNECTION;
+  state->written = mftb();
+  for (int i = 0; i < GCN_CONTROLLER_COUNT; i++)
+    state->changed[i] = adapter->state[adapter->published].seq + 1;
+  gcnStatePublish(adapter, state);
+}
+
+static void recordHistory(
+  struct history *history, const PADData_t *pad, uint32_t now
+) {
+  WUP028Sample_t *sample =
+    &history->samples[history->head % WUP028_HISTORY_SIZE];
+  sample->data = *pad;
+  sample->time = now;
+  compiler_barrier();
+  history->head++;
+}
+
+/* Whether one controller's 9 bytes differ between two reports. */
+static int portChanged(const uint8_t *data, const uint8_t *last) {
+  uint32_t data0, data1, last0, last1;
+  /* Copied as the slices aren't word aligned. */
+  __builtin_memcpy(&data0, data, 4);
+  __builtin_memcpy(&data1, data + 4, 4);
+  __builtin_memcpy(&last0, last, 4);
+  __builtin_memcpy(&last1, last + 4, 4);
+  return ((data0 ^ last0) | (data1 ^ last1) | (data[8] ^ last[8])) != 0;
+}
+
+/* Decodes a report from the adapter and publishes it as of time now. Returns
+ * a bit per controller connected. */
+static uint8_t decodeReport(
+  struct adapter *adapter, const uint8_t *report, uint32_t now
+) {
+  struct gcn_state *state = gcnStateBegin(adapter);
+  const struct gcn_state *last = &adapter->state[adapter->published];
+  /* last_report only describes last if nothing else was published since. */
+  int reuse = last->seq == adapter->last_report_seq;
+  uint8_t connected = 0;
+  uint8_t power = 0;
+  for (int i = 0; i < GCN_CONTROLLER_COUNT; i++) {
+    const uint8_t *data = report + (i * 9 + 1);
+    uint8_t *last_data = adapter->last_report + (i * 9 + 1);
+    PADData_t *pad = &state->data[i];
+    power |= data[0] & WUP_028_STATUS_POWER;
+    if (
+      reuse && !portChanged(data, last_data)
+      /* Unless it's waiting to be recalibrated. */
+      && (last->data[i].error != 0 || adapter->calibrated & (1 << i))
+    ) {
+      *pad = last->data[i];
+      state->changed[i] = last->changed[i];
+      if (pad->error == 0)
+        connected |= 1 << i;
+      recordHistory(&adapter->history[i], pad, now);
+      continue;
+    }
+    state->changed[i] = last->seq + 1;
+    for (int j = 0; j < 9; j++)
+      last_data[j] = data[j];
+    if ((data[0] >> 4) != 1 && (data[0] >> 4) != 2) {
+      pad->error = PADData_ERROR_NO_CONNECTION;
+      adapter->calibrated &= ~(1 << i);
+      recordHistory(&adapter->history[i], pad, now);
+      continue;
+    }
+    connected |= 1 << i;
+    struct calibration *calibration = &adapter->calibration[i];
+    if (!(adapter->calibrated & (1 << i))) {
+      calibrate(calibration, data);
+      adapter->calibrated |= 1 << i;
+    }
+    pad->buttons =
+      decode_buttons1[data[1]] |
+      decode_buttons2[data[2]] |
+      decode_trigger[data[7]] |
+      (decode_trigger[data[8]] >> 1);
+    pad->aStickX = calibration->stick[0][data[3]];
+    pad->aStickY = calibration->stick[1][data[4]];
+    pad->cStickX = calibration->stick[2][data[5]];
+    pad->cStickY = calibration->stick[3][data[6]];
+    pad->sliderL = decode_slider[data[7]];
+    pad->sliderR = decode_slider[data[8]];
+    pad->_unknown8 = 0;
+    pad->_unknown9 = 0;
+    pad->error = 0;
+#ifdef PROBE_LATENCY
+    if (adapter == &adapters[0])
+      probePress(i, pad, &adapter->state[adapter->published].data[i]);
+#endif
+    recordHistory(&adapter->history[i], pad, now);
+  }
+  state->written = now;
+  gcnStatePublish(adapter, state);
+  adapter->last_report_seq = state->seq;
+  adapter->rumble_power = power != 0;
+  return connected;
+}
+static void onDevUsbPoll(struct request *poll, ios_ret_t ret) {
+  struct adapter *adapter = poll->adapter;
+  wup028_counters.time = mftb();
+  adapter->polls_in_flight--;
+  /* The adapter was forgotten, e.g. the interface is being reopened. */
+  if (adapter->id == (uint32_t)-1) return;
+  if (ret >= 0) {
+    adapter->poll_time = wup028_counters.time;
+    adapter->watchdog_strikes = 0;
+    wup028_counters.polls_completed++;
+    cacheFromDevice(poll->buffer, WUP_028_POLL_SIZE);
+#ifdef CAPTURE_REPORTS
+    captureReport(adapter, poll->buffer, wup028_counters.time);
+#endif
+    uint8_t idle = adapter->idle;
+    if (poll->buffer[0] != 0x21)
+      wup028_counters.polls_bad++;
+    else if ((int32_t)(poll->order - adapter->poll_newest) <= 0)
+      wup028_counters.polls_stale++;
+    else {
+      adapter->poll_newest = poll->order;
+      idle = !decodeReport(adapter, poll->buffer, mftb());
+    }
+    if (idle) {
+      /* Leave the next poll to idlePoll. */
+      adapter->idle_time = wup028_counters.time + profile.poll_idle ms;
+      ret = 0;
+    } else if (adapter->idle)
+      /* Back to full rate. */
+      ret = fillPolls(adapter);
+    else
+#ifdef POLL_SCHEDULE
+      ret = schedulePoll(adapter, poll);
+#else
+      /* Usually just this poll's replacement, but also refills the pipeline
+       * after the watchdog restarts it with one. */
+      ret = fillPolls(adapter);
+#endif
+    adapter->idle = idle;
+  }
+  if (ret)
+    failAdapter(adapter, ret, 9);
+}
+#ifdef CAPTURE_REPORTS
+static void captureReport(
+  struct adapter *adapter, const uint8_t *data, uint32_t time
+) {
+  WUP028Report_t *report =
+    &wup028_capture.reports[wup028_capture.count % WUP028Capture_SIZE];
+  report->time = time;
+  report->adapter = adapter - adapters;
+  for (int i = 0; i < WUP028Report_SIZE; i++)
+    report->data[i] = data[i];
+  /* The report must be complete before a debugger can see it counted. */
+  compiler_barrier();
+  wup028_capture.count++;
+}
+#endif
+#ifdef REPLAY_REPORTS
+static void replayBegin(void) {
+  uint32_t count = wup028_capture.count;
+  replay_next = count > WUP028Capture_SIZE ? count - WUP028Capture_SIZE : 0;
+  replay_base = wup028_capture.reports[replay_next % WUP028Capture_SIZE].time;
+  replay_start = mftb();
+}
+/* Decodes every report now due, keeping the spacing of the recording. Each is
+ * decoded as of when it was due rather than when the game happened to call,
+ * so a capture always plays back the same way. Runs on the game's thread,
+ * which is only safe because no callbacks are running at all. */
+static void replayReports(void) {
+  uint32_t elapsed = mftb() - replay_start;
+  while (replay_next != wup028_capture.count) {
+    WUP028Report_t *report =
+      &wup028_capture.reports[replay_next % WUP028Capture_SIZE];
+    uint32_t offset = report->time - replay_base;
+    if ((int32_t)(offset - elapsed) > 0) break;
+    replay_next++;
+    wup028_counters.time = replay_start + offset;
+    wup028_counters.polls_completed++;
+    if (report->adapter >= WUP_028_MAX_ADAPTERS || report->data[0] != 0x21)
+      wup028_counters.polls_bad++;
+    else
+      decodeReport(
+        &adapters[report->adapter], report->data, wup028_counters.time
+      );
+  }
+}
+#endif